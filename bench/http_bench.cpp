@@ -0,0 +1,165 @@
+/**
+ * @file http_bench.cpp
+ *
+ * Benchmark of the HTTP parser in http.hpp
+ *
+ * Times parse_response() and parse_request() on typical heads of a bridge and a controller, the block
+ * scanners and Dechunker, each as the best of several runs with the data in the L1 cache, and prints the
+ * time per call and the throughput. Built by "make bench" in the build directory, not part of "make all".
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "../src/http.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Runs of each benchmark, the fastest counts
+const int runs=7;
+
+/// A response of the bridge to GET /description.xml, 14 headers
+const std::string response_head=
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx\r\n"
+    "Date: Sat, 17 Oct 2026 08:12:45 GMT\r\n"
+    "Content-Type: text/xml\r\n"
+    "Content-Length: 1163\r\n"
+    "Connection: close\r\n"
+    "Cache-Control: no-store, no-cache, must-revalidate, post-check=0, pre-check=0\r\n"
+    "Pragma: no-cache\r\n"
+    "Expires: Mon, 1 Aug 2011 09:00:00 GMT\r\n"
+    "Access-Control-Max-Age: 3600\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Access-Control-Allow-Credentials: true\r\n"
+    "Access-Control-Allow-Methods: POST, GET, OPTIONS, PUT, DELETE, HEAD\r\n"
+    "Access-Control-Allow-Headers: Content-Type\r\n"
+    "X-XSS-Protection: 1; mode=block\r\n"
+    "\r\n";
+
+/// A light state change of a controller, 11 headers
+const std::string request_head=
+    "PUT /api/7Fa3yZqXn2bLwD9kGhE0uJ4mRsTvC1oP/lights/12/state HTTP/1.1\r\n"
+    "Host: 192.168.1.20\r\n"
+    "User-Agent: Dalvik/2.1.0 (Linux; U; Android 13; Pixel 7 Build/TQ3A.230805.001)\r\n"
+    "Accept: application/json\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "Accept-Language: de-DE,de;q=0.9,en-US;q=0.8\r\n"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "Content-Length: 31\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Origin: http://192.168.1.20\r\n"
+    "Referer: http://192.168.1.20/debug/clip.html\r\n"
+    "\r\n";
+
+/// Keeps the results of the benchmarks alive
+static volatile size_t sink;
+
+/// Prints the best time per call of job, which handles bytes bytes per call.
+static void measure(const char *name, size_t bytes, size_t calls, const std::function<size_t()> &job)
+{
+    double best=0;
+    for (int run=0; run<runs; ++run)
+    {
+        const auto start=std::chrono::steady_clock::now();
+        for (size_t i=0; i<calls; ++i) sink+=job();
+        const double ns=std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-start).count();
+        if (!run || ns<best) best=ns;
+    }
+    best/=calls;
+    printf("%-30s %6zu bytes %10.1f ns %6.2f GB/s\n", name, bytes, best, bytes/best);
+}
+
+/// Checks that the parser accepts the head, so a broken head does not measure the error path.
+static void check(HttpResult result, const char *name)
+{
+    if (result==http_complete) return;
+    fprintf(stderr, "%s is not parsed as complete\n", name);
+    exit(1);
+}
+
+int main()
+{
+    HttpMessage m;
+    check(parse_response(response_head.data(), response_head.size(), m), "The response head");
+    check(parse_request(request_head.data(), request_head.size(), m), "The request head");
+
+    measure("parse_response", response_head.size(), 1000000, [&]()
+        {
+            parse_response(response_head.data(), response_head.size(), m);
+            return m.count;
+        });
+    measure("parse_request", request_head.size(), 1000000, [&]()
+        {
+            parse_request(request_head.data(), request_head.size(), m);
+            return m.count;
+        });
+
+    // The scanners on 4 KB of heads, a multiple of the block size
+    std::string page;
+    while (page.size()<4096) page+=response_head;
+    page.resize(4096);
+    std::vector<http_detail::Block> blocks(page.size()/64);
+    const std::pair<const char*, http_detail::Scan> scanners[]=
+    {
+        {"block scan, scalar", http_detail::scan_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"block scan, SSE2", http_detail::scan_sse2},
+        {"block scan, AVX2", __builtin_cpu_supports("avx2") ? http_detail::scan_avx2 : nullptr},
+#endif
+    };
+    for (const auto &s: scanners)
+    {
+        if (!s.second) continue;
+        measure(s.first, page.size(), 100000, [&]()
+            {
+                s.second(page.data(), blocks.size(), blocks.data());
+                return static_cast<size_t>(blocks[0].nl);
+            });
+    }
+
+    // A chunked body of 16 chunks of 4000 bytes, decoded from a fresh copy each call
+    std::string chunked;
+    for (int i=0; i<16; ++i) chunked+="fa0\r\n"+std::string(4000, 'a'+i)+"\r\n";
+    chunked+="0\r\n\r\n";
+    std::string body;
+    measure("Dechunker, 4000 byte chunks", chunked.size(), 20000, [&]()
+        {
+            body=chunked;
+            size_t bytes=body.size();
+            Dechunker().decode(&body[0], bytes);
+            return bytes;
+        });
+    return 0;
+}
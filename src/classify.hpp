@@ -0,0 +1,255 @@
+/**
+ * @file classify.hpp
+ *
+ * Vectorized classifier for SSDP datagrams
+ *
+ * Most datagrams on the SSDP port are NOTIFYs of other devices or garbage, which have to be rejected at
+ * line rate. classify() checks the request line of an M-SEARCH with one comparison and finds the line
+ * breaks and colons of the headers with SIMD compares, 32 bytes per step with AVX2 and 16 bytes with SSE2.
+ * The instruction set is chosen at runtime, other architectures use a scalar loop. The headers are
+ * evaluated as views into the datagram, nothing is copied or allocated.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CLASSIFY_HPP
+#define CLASSIFY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/// The headers of an M-SEARCH which hued evaluates, as views into the datagram
+struct Search
+{
+    std::string_view st;    ///< The service type, empty if missing
+    std::string_view mx;    ///< The maximum response delay in seconds, empty if missing
+};
+
+namespace classify_detail
+{
+
+/// Longest datagram evaluated, the rest is ignored
+const size_t max_bytes=2048;
+
+/**
+ * Sets bit i of nl if data[i] is '\n' and bit i of colon if it is ':', for i<bytes.
+ * Both bitmaps have (bytes+63)/64 words.
+ */
+typedef void (*Scan)(const char *data, size_t bytes, uint64_t *nl, uint64_t *colon);
+
+inline void scan_scalar(const char *data, size_t bytes, uint64_t *nl, uint64_t *colon)
+{
+    memset(nl, 0, (bytes+63)/64*8);
+    memset(colon, 0, (bytes+63)/64*8);
+    for (size_t i=0; i<bytes; ++i)
+    {
+        nl[i/64]|=static_cast<uint64_t>(data[i]=='\n')<<(i%64);
+        colon[i/64]|=static_cast<uint64_t>(data[i]==':')<<(i%64);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/// Scans one block of 64 bytes.
+inline void block_sse2(const char *data, uint64_t &nl, uint64_t &colon)
+{
+    const __m128i newline=_mm_set1_epi8('\n'), col=_mm_set1_epi8(':');
+    nl=colon=0;
+    for (size_t j=0; j<64; j+=16)
+    {
+        const __m128i v=_mm_loadu_si128(reinterpret_cast<const __m128i*>(data+j));
+        nl|=static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline))))<<j;
+        colon|=static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, col))))<<j;
+    }
+}
+
+__attribute__((target("avx2")))
+inline void block_avx2(const char *data, uint64_t &nl, uint64_t &colon)
+{
+    const __m256i newline=_mm256_set1_epi8('\n'), col=_mm256_set1_epi8(':');
+    const __m256i lo=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    const __m256i hi=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data+32));
+    nl=static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)))|
+        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline))))<<32;
+    colon=static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, col)))|
+        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, col))))<<32;
+}
+
+/// Scans all blocks, the last partial block is copied to a zero padded buffer first.
+inline void scan_sse2(const char *data, size_t bytes, uint64_t *nl, uint64_t *colon)
+{
+    size_t i=0;
+    for (; i+64<=bytes; i+=64) block_sse2(data+i, nl[i/64], colon[i/64]);
+    if (i==bytes) return;
+    char tail[64]={};
+    memcpy(tail, data+i, bytes-i);
+    block_sse2(tail, nl[i/64], colon[i/64]);
+}
+
+__attribute__((target("avx2")))
+inline void scan_avx2(const char *data, size_t bytes, uint64_t *nl, uint64_t *colon)
+{
+    size_t i=0;
+    for (; i+64<=bytes; i+=64) block_avx2(data+i, nl[i/64], colon[i/64]);
+    if (i==bytes) return;
+    char tail[64]={};
+    memcpy(tail, data+i, bytes-i);
+    block_avx2(tail, nl[i/64], colon[i/64]);
+}
+#endif
+
+/// Returns the best scanner of this CPU, chosen once.
+inline Scan scanner()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const Scan scan=__builtin_cpu_supports("avx2") ? scan_avx2 :
+        __builtin_cpu_supports("sse2") ? scan_sse2 : scan_scalar;
+#else
+    static const Scan scan=scan_scalar;
+#endif
+    return scan;
+}
+
+/// Finds the first set bit at or after position from, returns end if there is none before end.
+inline size_t next(const uint64_t *bits, size_t from, size_t end)
+{
+    for (size_t w=from/64; w*64<end; ++w)
+    {
+        const uint64_t word=bits[w]&(w==from/64 ? ~uint64_t(0)<<(from%64) : ~uint64_t(0));
+        if (word)
+        {
+            const size_t i=w*64+__builtin_ctzll(word);
+            return i<end ? i : end;
+        }
+    }
+    return end;
+}
+
+inline bool space(char c)
+{
+    return c==' ' || c=='\t' || c=='\r' || c=='\n' || c=='\v' || c=='\f';
+}
+
+/// Case insensitive comparison of a header name
+inline bool named(std::string_view name, char a, char b)
+{
+    return name.size()==2 && (name[0]|0x20)==a && (name[1]|0x20)==b;
+}
+
+/// Checks the request line of an M-SEARCH.
+inline bool request_line(const char *data, size_t bytes)
+{
+    static const char request[]="M-SEARCH * HTTP/1.1";
+    return bytes>=sizeof(request)-1 && memcmp(data, request, sizeof(request)-1)==0;
+}
+
+/// Extracts the ST and MX headers of an M-SEARCH with the given scanner.
+inline void headers(Scan scan, const char *data, size_t bytes, Search &search)
+{
+    if (bytes>max_bytes) bytes=max_bytes;
+    uint64_t nl[max_bytes/64], colon[max_bytes/64];
+    scan(data, bytes, nl, colon);
+
+    search=Search();
+    for (size_t line=next(nl, 0, bytes)+1; line<bytes; )
+    {
+        const size_t end=next(nl, line, bytes);
+        const size_t c=next(colon, line, end);
+        // Only names of two characters matter, the value is the first word after the colon
+        if (c<end && c>=line+2 && (c==line+2 || space(data[c-3])))
+        {
+            std::string_view *value=named(std::string_view(data+c-2, 2), 's', 't') ? &search.st :
+                named(std::string_view(data+c-2, 2), 'm', 'x') ? &search.mx : nullptr;
+            if (value)
+            {
+                size_t v=c+1;
+                while (v<end && space(data[v])) ++v;
+                size_t e=v;
+                while (e<end && !space(data[e])) ++e;
+                *value=std::string_view(data+v, e-v);
+            }
+        }
+        line=end+1;
+    }
+}
+
+}
+
+/**
+ * Checks if a datagram is an M-SEARCH request and extracts its ST and MX headers.
+ *
+ * Header names are compared case insensitively, a later header replaces an earlier one of the same name.
+ *
+ * \param data      The UDP payload
+ * \param bytes     The length of the payload
+ * \param search    Receives the headers, views into data
+ * \return          False if the datagram is no M-SEARCH
+ */
+inline bool classify(const char *data, size_t bytes, Search &search)
+{
+    using namespace classify_detail;
+    if (!request_line(data, bytes)) return false;
+    headers(scanner(), data, bytes, search);
+    return true;
+}
+
+/**
+ * Classifies a batch of datagrams, like the result of one recvmmsg().
+ *
+ * The request lines of all datagrams are checked first, so the NOTIFYs and garbage of a batch are
+ * rejected in one tight loop, then the headers of the M-SEARCHes are scanned one after the other with
+ * the scanner looked up once.
+ *
+ * \param datagrams The UDP payloads
+ * \param count     The number of datagrams
+ * \param searches  Receives the headers of datagram i in searches[i], if it is an M-SEARCH
+ * \param found     Receives in found[i] if datagram i is an M-SEARCH
+ * \return          The number of M-SEARCHes
+ */
+inline size_t classify(const std::string_view *datagrams, size_t count, Search *searches, bool *found)
+{
+    using namespace classify_detail;
+    size_t n=0;
+    for (size_t i=0; i<count; ++i)
+    {
+        found[i]=request_line(datagrams[i].data(), datagrams[i].size());
+        n+=found[i];
+    }
+    if (!n) return 0;
+    const Scan scan=scanner();
+    for (size_t i=0; i<count; ++i)
+        if (found[i]) headers(scan, datagrams[i].data(), datagrams[i].size(), searches[i]);
+    return n;
+}
+
+#endif // CLASSIFY_HPP
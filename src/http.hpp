@@ -0,0 +1,581 @@
+/**
+ * @file http.hpp
+ *
+ * Vectorized parser for HTTP/1.x messages
+ *
+ * parse_request() and parse_response() split the head of a message into the start line and the headers
+ * without copying or allocating anything, all fields are views into the receive buffer. Like classify(),
+ * the head is scanned in blocks of 64 bytes for line breaks, colons and control characters with SIMD
+ * compares (AVX2 or SSE2, chosen at runtime), so finding a line or a header name costs a count of
+ * trailing zeros instead of a loop over the bytes. Content-Length and Transfer-Encoding are evaluated
+ * on the way, a chunked body is decoded in place by Dechunker.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HTTP_HPP
+#define HTTP_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/// Longest head of a message, a longer head is invalid
+const size_t http_max_head=16384;
+/// Most headers of a message, more headers are invalid
+const size_t http_max_headers=48;
+
+enum HttpResult
+{
+    http_complete,      ///< The head or body is complete
+    http_incomplete,    ///< More bytes are needed
+    http_invalid        ///< The message is malformed or too large
+};
+
+/// A header as views into the head
+struct HttpHeader
+{
+    std::string_view name;
+    std::string_view value; ///< Without the surrounding whitespace
+};
+
+/// The head of a request or response as views into the receive buffer
+struct HttpMessage
+{
+    std::string_view method;    ///< The method of a request
+    std::string_view target;    ///< The request target of a request
+    uint16_t status=0;          ///< The status code of a response
+    std::string_view reason;    ///< The reason phrase of a response
+    uint8_t minor=0;            ///< The minor version, HTTP/1.minor
+    HttpHeader headers[http_max_headers];
+    size_t count=0;             ///< The number of headers
+    bool has_length=false;      ///< A Content-Length was given
+    uint64_t length=0;          ///< The Content-Length
+    bool chunked=false;         ///< The last transfer coding is chunked
+    size_t head=0;              ///< The length of the head including the empty line
+
+    /// Returns the value of the first header with this name, compared case insensitively, or an empty view.
+    std::string_view header(std::string_view name) const;
+};
+
+namespace http_detail
+{
+
+/// Bitmaps of 64 bytes, bit i is set if byte i is a line feed, a colon or a control character
+struct Block
+{
+    uint64_t nl;
+    uint64_t colon;
+    uint64_t ctl;   ///< Control characters besides tab and line feed, including carriage return and DEL
+};
+
+/// Scans the given number of complete blocks.
+typedef void (*Scan)(const char *data, size_t blocks, Block *out);
+
+inline void scan_scalar(const char *data, size_t blocks, Block *out)
+{
+    for (size_t b=0; b<blocks; ++b, data+=64)
+    {
+        Block &block=out[b];
+        block=Block{0, 0, 0};
+        for (size_t i=0; i<64; ++i)
+        {
+            const unsigned char c=data[i];
+            block.nl|=static_cast<uint64_t>(c=='\n')<<i;
+            block.colon|=static_cast<uint64_t>(c==':')<<i;
+            block.ctl|=static_cast<uint64_t>((c<0x20 && c!='\t' && c!='\n') || c==0x7f)<<i;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+inline void scan_sse2(const char *data, size_t blocks, Block *out)
+{
+    const __m128i newline=_mm_set1_epi8('\n'), col=_mm_set1_epi8(':'), tab=_mm_set1_epi8('\t');
+    const __m128i us=_mm_set1_epi8(0x1f), del=_mm_set1_epi8(0x7f);
+    for (size_t b=0; b<blocks; ++b, data+=64)
+    {
+        uint64_t nl=0, colon=0, ctl=0;
+        for (size_t j=0; j<64; j+=16)
+        {
+            const __m128i v=_mm_loadu_si128(reinterpret_cast<const __m128i*>(data+j));
+            const __m128i n=_mm_cmpeq_epi8(v, newline);
+            // max(v, 0x1f)==0x1f is an unsigned v<0x20, the bytes from 0x80 on are allowed
+            const __m128i c=_mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, us), us), _mm_cmpeq_epi8(v, del));
+            nl|=static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(n)))<<j;
+            colon|=static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, col))))<<j;
+            ctl|=static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(
+                _mm_andnot_si128(_mm_or_si128(n, _mm_cmpeq_epi8(v, tab)), c))))<<j;
+        }
+        out[b]=Block{nl, colon, ctl};
+    }
+}
+
+__attribute__((target("avx2")))
+inline uint64_t mask_avx2(__m256i lo, __m256i hi)
+{
+    return static_cast<uint32_t>(_mm256_movemask_epi8(lo))|
+        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(hi)))<<32;
+}
+
+/// Control characters of 32 bytes besides the line feeds n and tabs
+__attribute__((target("avx2")))
+inline __m256i ctl_avx2(__m256i v, __m256i n)
+{
+    const __m256i us=_mm256_set1_epi8(0x1f);
+    const __m256i c=_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, us), us),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+    return _mm256_andnot_si256(_mm256_or_si256(n, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))), c);
+}
+
+__attribute__((target("avx2")))
+inline void scan_avx2(const char *data, size_t blocks, Block *out)
+{
+    const __m256i newline=_mm256_set1_epi8('\n'), col=_mm256_set1_epi8(':');
+    for (size_t b=0; b<blocks; ++b, data+=64)
+    {
+        const __m256i lo=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        const __m256i hi=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data+32));
+        const __m256i nlo=_mm256_cmpeq_epi8(lo, newline), nhi=_mm256_cmpeq_epi8(hi, newline);
+        out[b]=Block{mask_avx2(nlo, nhi), mask_avx2(_mm256_cmpeq_epi8(lo, col), _mm256_cmpeq_epi8(hi, col)),
+            mask_avx2(ctl_avx2(lo, nlo), ctl_avx2(hi, nhi))};
+    }
+}
+#endif
+
+/// Returns the best scanner of this CPU, chosen once.
+inline Scan scanner()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const Scan scan=__builtin_cpu_supports("avx2") ? scan_avx2 :
+        __builtin_cpu_supports("sse2") ? scan_sse2 : scan_scalar;
+#else
+    static const Scan scan=scan_scalar;
+#endif
+    return scan;
+}
+
+/// Scans the head lazily, a few blocks ahead of the parser, so the body behind the head is not touched.
+class Scanner
+{
+private:
+    static constexpr size_t ahead=4;    ///< Blocks scanned at once
+    const char *_data;
+    size_t _bytes;
+    size_t _scanned;                ///< Blocks scanned so far
+    size_t _word;                   ///< The block of the line feed cursor
+    uint64_t _nl;                   ///< The line feeds of this block not returned yet
+    Scan _scan;
+    Block _blocks[http_max_head/64];
+
+    /// Scans up to block w.
+    void upto(size_t w)
+    {
+        while (_scanned<=w)
+        {
+            const size_t full=std::min(ahead, _bytes/64-_scanned);
+            if (full)
+            {
+                _scan(_data+_scanned*64, full, _blocks+_scanned);
+                _scanned+=full;
+                continue;
+            }
+            // The last partial block is copied to a padded buffer, the bits behind the data are cleared
+            char tail[64]={};
+            const size_t rest=_bytes-_scanned*64;
+            memcpy(tail, _data+_scanned*64, rest);
+            _scan(tail, 1, _blocks+_scanned);
+            const uint64_t mask=rest ? ~uint64_t(0)>>(64-rest) : 0;
+            _blocks[_scanned].nl&=mask;
+            _blocks[_scanned].colon&=mask;
+            _blocks[_scanned].ctl&=mask;
+            ++_scanned;
+        }
+    }
+
+public:
+    Scanner(const char *data, size_t bytes) :
+        _data(data), _bytes(bytes), _scanned(0), _word(0), _nl(0), _scan(scanner())
+    {
+        if (!bytes) return;
+        upto(0);
+        _nl=_blocks[0].nl;
+    }
+
+    /// Returns the position of the next line feed, or the number of bytes if there is none.
+    size_t line_feed()
+    {
+        while (!_nl)
+        {
+            if (++_word*64>=_bytes) return _bytes;
+            upto(_word);
+            _nl=_blocks[_word].nl;
+        }
+        const size_t i=_word*64+__builtin_ctzll(_nl);
+        _nl&=_nl-1;
+        return i;
+    }
+
+    /// Returns the position of the first colon at or after from, or end if there is none before end.
+    size_t colon(size_t from, size_t end)
+    {
+        for (size_t w=from/64; w*64<end; ++w)
+        {
+            upto(w);
+            const uint64_t word=_blocks[w].colon&(w==from/64 ? ~uint64_t(0)<<(from%64) : ~uint64_t(0));
+            if (word)
+            {
+                const size_t i=w*64+__builtin_ctzll(word);
+                return i<end ? i : end;
+            }
+        }
+        return end;
+    }
+
+    /**
+     * Checks that the first bytes contain no control characters, besides the byte before each line feed,
+     * which the parser checks to be a carriage return.
+     */
+    bool clean(size_t bytes) const
+    {
+        for (size_t w=0; w*64<bytes; ++w)
+        {
+            const Block &b=_blocks[w];
+            const uint64_t before_nl=b.nl>>1|(w+1<_scanned ? _blocks[w+1].nl<<63 : 0);
+            uint64_t bad=b.ctl&~before_nl;
+            if (bytes-w*64<64) bad&=~uint64_t(0)>>(64-(bytes-w*64));
+            if (bad) return false;
+        }
+        return true;
+    }
+};
+
+inline char lower(char c)
+{
+    return c>='A' && c<='Z' ? c+('a'-'A') : c;
+}
+
+/// Case insensitive comparison with a lower case name
+inline bool iequals(std::string_view a, std::string_view lower_name)
+{
+    if (a.size()!=lower_name.size()) return false;
+    for (size_t i=0; i<a.size(); ++i)
+        if (lower(a[i])!=lower_name[i]) return false;
+    return true;
+}
+
+inline bool ows(char c)
+{
+    return c==' ' || c=='\t';
+}
+
+/// Parses "HTTP/1.x", returns false for other versions.
+inline bool version(std::string_view v, uint8_t &minor)
+{
+    if (v.size()!=8 || memcmp(v.data(), "HTTP/1.", 7)!=0 || v[7]<'0' || v[7]>'9') return false;
+    minor=v[7]-'0';
+    return true;
+}
+
+/// Returns the end of the line before the line feed at nl without its carriage return, npos after a control character.
+inline size_t line_end(const char *data, size_t line, size_t nl)
+{
+    if (nl==line) return nl;
+    const unsigned char c=data[nl-1];
+    if (c=='\r') return nl-1;
+    return (c<0x20 && c!='\t') || c==0x7f ? std::string_view::npos : nl;
+}
+
+/// Finds the start line, its length is returned in end.
+inline HttpResult start_line(const char *data, size_t bytes, Scanner &s, size_t &nl, size_t &end)
+{
+    nl=s.line_feed();
+    if (nl==bytes) return bytes<http_max_head ? http_incomplete : http_invalid;
+    end=line_end(data, 0, nl);
+    return end==std::string_view::npos ? http_invalid : http_complete;
+}
+
+/// Parses the header lines behind the start line ending with the line feed at nl.
+inline HttpResult headers(const char *data, size_t bytes, Scanner &s, size_t nl, HttpMessage &m)
+{
+    for (size_t line=nl+1; ; line=nl+1)
+    {
+        nl=s.line_feed();
+        if (nl==bytes) return bytes<http_max_head ? http_incomplete : http_invalid;
+        const size_t end=line_end(data, line, nl);
+        if (end==std::string_view::npos) return http_invalid;
+        if (end==line)
+        {
+            m.head=nl+1;
+            if (!s.clean(m.head)) return http_invalid;
+            // A length and a chunked body contradict each other, a proxy must not guess
+            return m.chunked && m.has_length ? http_invalid : http_complete;
+        }
+
+        // No obsolete line folding, no whitespace between name and colon
+        const size_t colon=s.colon(line, end);
+        if (colon==end || colon==line || ows(data[line]) || ows(data[colon-1]) || m.count==http_max_headers)
+            return http_invalid;
+        size_t v=colon+1, e=end;
+        while (v<e && ows(data[v])) ++v;
+        while (e>v && ows(data[e-1])) --e;
+        HttpHeader &h=m.headers[m.count++];
+        h.name=std::string_view(data+line, colon-line);
+        h.value=std::string_view(data+v, e-v);
+
+        if (iequals(h.name, "content-length"))
+        {
+            if (h.value.empty() || h.value.size()>18) return http_invalid;
+            uint64_t length=0;
+            for (char c: h.value)
+            {
+                if (c<'0' || c>'9') return http_invalid;
+                length=length*10+(c-'0');
+            }
+            if (m.has_length && length!=m.length) return http_invalid;
+            m.has_length=true;
+            m.length=length;
+        }
+        else if (iequals(h.name, "transfer-encoding"))
+        {
+            // The last coding of the last header counts
+            m.chunked=h.value.size()>=7 && iequals(h.value.substr(h.value.size()-7), "chunked") &&
+                (h.value.size()==7 || h.value[h.value.size()-8]==',' || ows(h.value[h.value.size()-8]));
+        }
+    }
+}
+
+}
+
+inline std::string_view HttpMessage::header(std::string_view name) const
+{
+    for (size_t i=0; i<count; ++i)
+    {
+        if (headers[i].name.size()!=name.size()) continue;
+        size_t j=0;
+        while (j<name.size() && http_detail::lower(headers[i].name[j])==http_detail::lower(name[j])) ++j;
+        if (j==name.size()) return headers[i].value;
+    }
+    return std::string_view();
+}
+
+/**
+ * Parses the head of a request "METHOD TARGET HTTP/1.x".
+ *
+ * \param data      The received bytes, the head does not need to be complete
+ * \param bytes     The number of received bytes
+ * \param m         Receives the head, views into data
+ * \return          http_incomplete until the empty line after the headers was received
+ */
+inline HttpResult parse_request(const char *data, size_t bytes, HttpMessage &m)
+{
+    using namespace http_detail;
+    m.count=0;
+    m.has_length=m.chunked=false;
+    m.length=0;
+    bytes=std::min(bytes, http_max_head);
+    Scanner s(data, bytes);
+    size_t nl, end;
+    const HttpResult r=start_line(data, bytes, s, nl, end);
+    if (r!=http_complete) return r;
+
+    const std::string_view line(data, end);
+    const size_t sp1=line.find(' ');
+    const size_t sp2=sp1==std::string_view::npos ? sp1 : line.find(' ', sp1+1);
+    if (sp1==0 || sp2==std::string_view::npos || sp2==sp1+1 || !version(line.substr(sp2+1), m.minor))
+        return http_invalid;
+    m.method=line.substr(0, sp1);
+    m.target=line.substr(sp1+1, sp2-sp1-1);
+    m.status=0;
+    m.reason=std::string_view();
+    return headers(data, bytes, s, nl, m);
+}
+
+/**
+ * Parses the head of a response "HTTP/1.x STATUS REASON".
+ *
+ * \param data      The received bytes, the head does not need to be complete
+ * \param bytes     The number of received bytes
+ * \param m         Receives the head, views into data
+ * \return          http_incomplete until the empty line after the headers was received
+ */
+inline HttpResult parse_response(const char *data, size_t bytes, HttpMessage &m)
+{
+    using namespace http_detail;
+    m.count=0;
+    m.has_length=m.chunked=false;
+    m.length=0;
+    bytes=std::min(bytes, http_max_head);
+    Scanner s(data, bytes);
+    size_t nl, end;
+    const HttpResult r=start_line(data, bytes, s, nl, end);
+    if (r!=http_complete) return r;
+
+    // The reason phrase may be empty, even its space is missing sometimes
+    const std::string_view line(data, end);
+    if (line.size()<12 || !version(line.substr(0, 8), m.minor) || line[8]!=' ' ||
+        (line.size()>12 && line[12]!=' '))
+        return http_invalid;
+    m.status=0;
+    for (size_t i=9; i<12; ++i)
+    {
+        if (line[i]<'0' || line[i]>'9') return http_invalid;
+        m.status=m.status*10+(line[i]-'0');
+    }
+    m.reason=line.size()>12 ? line.substr(13) : std::string_view();
+    m.method=m.target=std::string_view();
+    return headers(data, bytes, s, nl, m);
+}
+
+/**
+ * Decoder of the chunked transfer coding.
+ *
+ * The body is decoded in place: the data of the chunks is moved to the front of the buffer over the
+ * chunk sizes, extensions and trailers, which are dropped. The body may arrive in any pieces.
+ */
+class Dechunker
+{
+private:
+    enum State
+    {
+        state_size,         ///< In the hex digits of the chunk size
+        state_extension,    ///< Behind the size, up to the line feed
+        state_data,         ///< In the data of a chunk
+        state_data_cr,      ///< Behind the data of a chunk
+        state_data_lf,      ///< Behind the carriage return after the data
+        state_trailer,      ///< At the start of a trailer line or the final empty line
+        state_trailer_line, ///< In a trailer line
+        state_last_lf,      ///< Behind the carriage return of the final empty line
+        state_done
+    };
+    State _state=state_size;
+    uint64_t _left=0;       ///< The size or the rest of the current chunk
+    size_t _digits=0;
+
+public:
+    /**
+     * Decodes the next piece of a chunked body.
+     *
+     * \param data      The bytes received after the previous piece
+     * \param bytes     Their number, receives the number of decoded bytes now at the start of data
+     * \return          http_complete after the last chunk and the trailers, bytes behind them are ignored
+     */
+    HttpResult decode(char *data, size_t &bytes)
+    {
+        size_t src=0, dst=0;
+        while (src<bytes && _state!=state_done)
+        {
+            const char c=data[src];
+            switch (_state)
+            {
+            case state_size:
+                {
+                    const int digit=c>='0' && c<='9' ? c-'0' : c>='a' && c<='f' ? c-'a'+10 :
+                        c>='A' && c<='F' ? c-'A'+10 : -1;
+                    if (digit>=0)
+                    {
+                        if (++_digits>15) return http_invalid;
+                        _left=_left*16+digit;
+                        ++src;
+                    }
+                    else if (_digits && (c==';' || c=='\r' || c==' ' || c=='\t')) _state=state_extension;
+                    else if (_digits && c=='\n') _state=state_extension;
+                    else return http_invalid;
+                }
+                break;
+            case state_extension:
+                {
+                    const char *nl=static_cast<const char*>(memchr(data+src, '\n', bytes-src));
+                    if (!nl)
+                    {
+                        src=bytes;
+                        break;
+                    }
+                    src=nl-data+1;
+                    _digits=0;
+                    _state=_left ? state_data : state_trailer;
+                }
+                break;
+            case state_data:
+                {
+                    const size_t n=std::min<uint64_t>(_left, bytes-src);
+                    memmove(data+dst, data+src, n);
+                    src+=n;
+                    dst+=n;
+                    _left-=n;
+                    if (!_left) _state=state_data_cr;
+                }
+                break;
+            case state_data_cr:
+                if (c!='\r' && c!='\n') return http_invalid;
+                _state=c=='\r' ? state_data_lf : state_size;
+                ++src;
+                break;
+            case state_data_lf:
+                if (c!='\n') return http_invalid;
+                _state=state_size;
+                ++src;
+                break;
+            case state_trailer:
+                _state=c=='\n' ? state_done : c=='\r' ? state_last_lf : state_trailer_line;
+                if (_state!=state_trailer_line) ++src;
+                break;
+            case state_trailer_line:
+                {
+                    const char *nl=static_cast<const char*>(memchr(data+src, '\n', bytes-src));
+                    src=nl ? nl-data+1 : bytes;
+                    if (nl) _state=state_trailer;
+                }
+                break;
+            case state_last_lf:
+                if (c!='\n') return http_invalid;
+                _state=state_done;
+                ++src;
+                break;
+            case state_done:
+                break;
+            }
+        }
+        bytes=dst;
+        return _state==state_done ? http_complete : http_incomplete;
+    }
+
+    /// Checks if the last chunk and the trailers were decoded.
+    bool done() const
+    {
+        return _state==state_done;
+    }
+};
+
+#endif // HTTP_HPP
@@ -14,7 +14,112 @@
  * elsewhere, in a docker container or around the world.
  *
  * The daemon requires one parameter in the form "server:service", e.g.
- * "my-hue.local:80".
+ * "my-hue.local:80", for each bridge. Options:
+ *
+ *  --txtime[=monotonic|tai]  Hand the responses to the kernel immediately
+ *                            with an SCM_TXTIME launch time instead of
+ *                            waiting for the MX delay in a userspace timer.
+ *                            Requires the fq (monotonic) or etf (tai) qdisc.
+ *  --slack=MS                Power saving: align response deadlines and
+ *                            cache refreshes to a grid of MS milliseconds
+ *                            (within the MX of each request), so timers
+ *                            expire together and the CPU wakes up rarely.
+ *  --fast=NET/LEN[@MS]       Respond to searches from this subnet after a
+ *                            fixed delay of MS milliseconds (default 0, i.e.
+ *                            immediately) instead of a random delay within
+ *                            MX. May be given more than once.
+ *  --busy-poll=US            Busy poll the SSDP socket for up to US
+ *                            microseconds (SO_BUSY_POLL).
+ *  --route=NET/LEN=BRIDGES   Advertise only the comma separated bridges
+ *                            (given as "server:service") to requesters in
+ *                            this subnet, or none if BRIDGES is "deny". The
+ *                            longest matching prefix wins, requesters
+ *                            without a route get all bridges.
+ *  --known=NET/LEN           Requesters in this subnet are known controllers,
+ *                            which are served first under overload. Fast
+ *                            subnets are known as well, requesters which
+ *                            searched repeatedly before an overload come
+ *                            next.
+ *  --max-pending=N           Queue at most N responses per bridge (default
+ *                            1024), unknown requesters are shed first.
+ *  --rate=N                  Send at most N response telegrams per second,
+ *                            a quarter of the budget is reserved for known
+ *                            controllers.
+ *  --watchdog=MS             Report stalls of the event loop longer than MS
+ *                            milliseconds with a backtrace of the blocked
+ *                            thread.
+ *  --max-fetches=N           Download at most N description.xml documents
+ *                            at the same time (default 4).
+ *  --events=PATH             Subscribe to the server-sent events at PATH of
+ *                            each bridge and download the description.xml
+ *                            on each event instead of polling frequently.
+ *  --events-key=KEY          Send KEY as hue-application-key header with
+ *                            the event subscription.
+ *  --static=SERVER:SERVICE,uuid=UUID[,bridgeid=ID][,serial=SN][,name=NAME]
+ *                            A bridge with a fixed identity, which is never
+ *                            downloaded. May be given more than once.
+ *  --http=HOST:PORT          Serve the description.xml of the static
+ *                            bridges on PORT and advertise it at HOST.
+ *  --replica=BRIDGE=SERVER:SERVICE
+ *                            Another replica of the bridge BRIDGE (given as
+ *                            "server:service"). The replicas are probed and
+ *                            the bridge is advertised with the healthiest
+ *                            replica of the lowest latency. May be given
+ *                            more than once.
+ *  --probe=MS                Probe the replicas every MS milliseconds
+ *                            (default 5000).
+ *  --mdns                    Advertise the bridges by mDNS as _hue._tcp
+ *                            services as well.
+ *  --xdp=IFACE               Receive the searches on IFACE by an AF_XDP
+ *                            socket and send immediate responses (see
+ *                            --fast) through its TX ring. Falls back to the
+ *                            UDP socket if AF_XDP is not available.
+ *  --peers=GROUP:PORT        Coordinate with other instances by heartbeats
+ *                            to this multicast group, only the leader
+ *                            answers searches.
+ *  --peer-priority=N         The instance of the highest priority leads
+ *                            (default 100).
+ *  --heartbeat=MS            Send a heartbeat every MS milliseconds
+ *                            (default 1000).
+ *  --canary=MS               Search for the bridges on each interface every
+ *                            MS milliseconds and measure the discovery
+ *                            latency.
+ *  --canary-fetch            Let the canary download the LOCATION of the
+ *                            first response as well.
+ *  --farm=N                  Emulate N virtual bridges for load tests,
+ *                            needs --http.
+ *  --log=json|journal        Log the searches as JSON lines on stdout or to
+ *                            journald.
+ *  --log-rate=N              Log at most N events per second and type
+ *                            (default 100).
+ *  --proxy=BRIDGE=HOST:PORT  Proxy the API of the bridge BRIDGE (given as
+ *                            "server:service") on PORT and advertise it at
+ *                            HOST. Light state changes are written behind.
+ *  --coalesce=MS             Write the state of a light at most every MS
+ *                            milliseconds through the proxy (default 100).
+ *  --batch=MS                Send identical state changes of several lights
+ *                            within MS milliseconds as one group action
+ *                            through the proxy.
+ *  --upstream-window=N       Send at most N requests to a bridge at the same
+ *                            time (default 4, 0 for no limit). Waiting
+ *                            requests start by priority: writes through the
+ *                            proxy, other requests through the proxy, then
+ *                            refreshes and probes.
+ *  --emulate=HOST:PORT,uuid=UUID[,bridgeid=ID][,serial=SN][,name=NAME]
+ *                            Emulate a bridge with the Hue API in memory on
+ *                            PORT and advertise it at HOST, instead of or
+ *                            besides the real bridges.
+ *  --light=NAME[,dimmable|ct|color]
+ *                            A light of the emulated bridge (default color).
+ *                            The IDs count from 1 in the order given.
+ *  --group=NAME=IDS          A group of the comma separated light IDS of the
+ *                            emulated bridge.
+ *  --backend=exec:COMMAND|unix:PATH|mqtt:HOST:PORT[/PREFIX]
+ *                            Pass the state changes of the emulated lights
+ *                            to a command, a UNIX datagram socket or an
+ *                            MQTT broker.
+ *
+ * SIGUSR1 writes the statistics to stderr.
  *
  * @author Andreas Schmitt
  */
@@ -46,324 +151,871 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
-#include <boost/asio.hpp>
-#include <boost/bind/bind.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-#include <boost/lexical_cast.hpp>
-#include <boost/format.hpp>
-#include <unordered_map>
-#include <unordered_set>
-#include <regex>
-
-using namespace boost::asio;
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <execinfo.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include "hued.hpp"
 
-const uint16_t multicast_port=1900; ///< Listen on this port for SSDP requests
-const uint16_t t_refresh=300; ///< Cache the description.xml for this many seconds
-
-/// All three responses to an SSDP request start with this data
-const char HUE_RESPONSE[] =
-  "HTTP/1.1 200 OK\r\n"
-  "HOST: 239.255.255.250:1900\r\n"
-  "CACHE-CONTROL: max-age=100\r\n"
-  "EXT:\r\n"
-  "LOCATION: http://%1%:%2%/description.xml\r\n"
-  "SERVER: Linux/3.14.0 UPnP/1.0 IpBridge/1.24.0\r\n"  // was 1.17
-  "hue-bridgeid: %3%\r\n%4%";
-/// The first SSDP response is HUE_RESONSE+HUE_ST1
-const char HUE_ST1[] =
-  "ST: upnp:rootdevice\r\n"
-  "USN: uuid:%1%::upnp:rootdevice\r\n"
-  "\r\n";
-/// The second SSDP response is HUE_RESONSE+HUE_ST2
-const char HUE_ST2[] =
-  "ST: uuid:%1%\r\n"
-  "USN: uuid:%1%\r\n"
-  "\r\n";
-/// The third SSDP response is HUE_RESONSE+HUE_ST3
-const char HUE_ST3[] =
-  "ST: urn:schemas-upnp-org:device:basic:1\r\n"
-  "USN: uuid:%1%\r\n"
-  "\r\n";
-/// A list of service types to which hued responds. Those types can be found in the "ST:" field of the SSDP request.
-const std::unordered_set<std::string> service_types
-{
-    "urn:schemas-upnp-org:device:Basic:1",
-    "upnp:rootdevice",
-    "ssdpsearch:all",
-    "ssdp:all"
-};
-
-/// SSDP responder class
-class Responder
+/**
+ * Detects stalls of the event loop.
+ *
+ * Any blocking call in a handler, e.g. a synchronous download from a bridge, keeps all searches
+ * unanswered. The watchdog thread posts a heartbeat handler to the io_service and waits for it.
+ * If the heartbeat did not run within the threshold, the io thread is interrupted by a signal, whose
+ * handler records the backtrace of the blocking call. The watchdog writes it to stderr and counts the
+ * stall, its duration is written when the heartbeat finally runs.
+ */
+class Watchdog
 {
 private:
     io_service &_io_service;
-    std::string _server;
-    std::string _service;
-    std::string _uuid;
-    ip::udp::socket _socket;
-    bool _refresh;
-    deadline_timer _trefresh;
-    deadline_timer _tresponse;
+    Statistics &_stats;
+    const std::chrono::milliseconds _threshold;
+    const pthread_t _io_thread;
+    std::atomic<bool> _beat;    ///< The last heartbeat ran
+    std::chrono::steady_clock::time_point _posted;  ///< Time of the last heartbeat post, written by the watchdog only
+    std::atomic<int64_t> _lag;  ///< Lag of the last heartbeat in milliseconds
+    bool _stop;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
 
-public:
-    /// The constructor opens the UDP response port.
-    Responder(io_service &io_service, const std::string &server, const std::string &service) :
-        _io_service(io_service), _server(server), _service(service), _uuid(),
-        _socket(io_service), _refresh(true), _trefresh(io_service), _tresponse(io_service)
+    static const int _signal;
+    static void *_frames[64];
+    static volatile sig_atomic_t _depth;
+
+    /// Signal handler running on the io thread, records the backtrace of the blocking call.
+    static void capture(int)
     {
-        _socket.open(ip::udp::v4());
+        _depth=backtrace(_frames, sizeof(_frames)/sizeof(_frames[0]));
     }
 
+public:
     /**
-     * Update the UUID of the HUE bridge.
+     * Starts the watchdog thread for the io_service run by the calling thread.
      *
-     * For obtaining the UUID of the HUE bridge this function downloads the description.xml from the bridge,
-     * parses this document and reads the UUID. The function immediately returns if it is called during
-     * t_refresh seconds after the last call to prevent DOS to the HUE bridge.
+     * \param threshold     Stalls longer than this are reported
      */
-    void update()
+    Watchdog(io_service &io_service, Statistics &stats, std::chrono::milliseconds threshold) :
+        _io_service(io_service), _stats(stats), _threshold(threshold), _io_thread(pthread_self()), _beat(true),
+        _lag(0), _stop(false)
     {
-        if (_refresh)
-        {
-            _refresh=false;
-            _trefresh.expires_from_now(boost::posix_time::seconds(t_refresh));
-            _trefresh.async_wait(boost::bind(&Responder::refresh, this, placeholders::error));
-
-            ip::tcp::tcp::resolver resolver(_io_service);
-            ip::tcp::tcp::resolver::query query(_server, _service);
-            ip::tcp::tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-
-            ip::tcp::tcp::socket squery(_io_service);
-            connect(squery, endpoint_iterator);
-
-            // Build a HTTP request for description.xml
-            streambuf request;
-            std::ostream request_stream(&request);
-            request_stream << "GET /description.xml HTTP/1.0\r\n";
-            request_stream << "Host: " << _server << "\r\n";
-            request_stream << "Accept: */*\r\n";
-            request_stream << "Connection: close\r\n\r\n";
+        // backtrace() loads libgcc on its first call, which is not possible in a signal handler
+        _depth=backtrace(_frames, 1);
 
-            // Send the request.
-            write(squery, request);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler=capture;
+        sa.sa_flags=SA_RESTART;
+        sigaction(_signal, &sa, nullptr);
 
-            // Read the response status line. The response streambuf will automatically
-            // grow to accommodate the entire line. The growth may be limited by passing
-            // a maximum size to the streambuf constructor.
-            streambuf response;
-            read_until(squery, response, "\r\n");
-
-            // Check that response is OK.
-            std::istream response_stream(&response);
-            std::string http_version;
-            response_stream >> http_version;
-            uint16_t status_code;
-            response_stream >> status_code;
-            std::string status_message;
-            std::getline(response_stream, status_message);
-
-            // Invalid response
-            if (!response_stream || http_version.substr(0, 5) != "HTTP/") return;
-
-            // Wrong status code
-            if (status_code != 200) return;
-
-            // Read the response headers, which are terminated by a blank line.
-            read_until(squery, response, "\r\n\r\n");
-
-            // Process the response headers. Just discard the data.
-            std::string header;
-            while (std::getline(response_stream, header) && header != "\r");
-
-            // Read until EOF
-            boost::system::error_code error;
-            while (read(squery, response,
-                transfer_at_least(1), error));
-            if (error != error::eof)
-                throw boost::system::system_error(error);
-
-            // Create empty property tree object
-            boost::property_tree::ptree tree;
-
-            // Parse the XML into the property tree.
-            std::iostream xml(&response);
-            boost::property_tree::read_xml(xml, tree);
-
-            std::string uuid=tree.get<std::string>("root.device.UDN");
-            const std::string uu("uuid:");
-            if (uuid.find(uu)==0)
-            {
-                _uuid=uuid.substr(uu.length());
-            }
-        }
+        _thread=std::thread(&Watchdog::run, this);
     }
 
-    /**
-     * Starts the SSID response.
-     *
-     * The function calls update() to get the current UUDI of the HUE bridge. Then it starts an async
-     * timer of between 0 and a (pseudo) random time given by mx (in seconds), which triggers
-     * respond(). This mechanism reduces the DDOS problem for the enumerating device when each
-     * enumerated device in the subnet answers to the same request.
-     *
-     * \param addr      The address to respond to (HUE bridge)
-     * \param port      The port to respond to (HUE bridge)
-     * \param mx        An interval in seconds, in which the response should be sent.
-     */
-    void operator()(ip::address addr, uint16_t port, uint16_t mx)
+    ~Watchdog()
     {
-        update();
-        uint32_t t_response=static_cast<uint64_t>(mx)*1000*rand()/RAND_MAX;
-        _tresponse.expires_from_now(boost::posix_time::milliseconds(t_response));
-        _tresponse.async_wait(boost::bind(&Responder::respond, this, placeholders::error, addr, port));
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop=true;
+        }
+        _cv.notify_one();
+        _thread.join();
     }
 
 private:
-    /**
-     * Small helper to set the _refresh flag after the timeout t_refresh.
-     */
-    void refresh(const boost::system::error_code &e)
+    /// The heartbeat handler, runs on the io thread.
+    void heartbeat(std::chrono::steady_clock::time_point posted)
     {
-        if (e) return;
-        _refresh=true;
+        ++_stats.wakeups;
+        const int64_t lag=std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now()-posted).count();
+        _lag=lag;
+        if (lag>_threshold.count())
+            std::cerr << "Event loop was blocked for " << lag << " ms." << std::endl;
+        _beat=true;
     }
 
-    /**
-     * Sends three response telegrams (see #HUE_RESPONSE, #HUE_ST1, #HUE_ST2, #HUE_ST3) to the endpoint
-     * given by addr and port.
-     *
-     * \param e     If this async timer error code says something other than OK the fuction returns
-     *                  immediately.
-     * \param addr  The address of the SSDP enumerator
-     * \param port  The port of the SSDP enumerator
-     */
-    void respond(const boost::system::error_code &e, ip::address addr, uint16_t port)
+    /// The watchdog thread, checks the heartbeat twice per threshold.
+    void run()
     {
-        if (e) return;
-
-        const ip::udp::endpoint endpoint(addr, port);
+        bool reported=false;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_cv.wait_for(lock, _threshold/2, [this] { return _stop; }))
+        {
+            const std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+            if (_beat)
+            {
+                const uint64_t lag=_lag;
+                if (lag>static_cast<uint64_t>(_threshold.count()) && lag>_stats.stall_max) _stats.stall_max=lag;
+                reported=false;
+                _beat=false;
+                _posted=now;
+                _io_service.post(boost::bind(&Watchdog::heartbeat, this, now));
+                continue;
+            }
+            if (reported || now-_posted<_threshold) continue;
 
-        boost::format st1(HUE_ST1);
-        st1%_uuid;
-        boost::format st2(HUE_ST2);
-        st2%_uuid;
-        boost::format st3(HUE_ST3);
-        st3%_uuid;
-        boost::format msg1(HUE_RESPONSE);
-        boost::format msg2(HUE_RESPONSE);
-        boost::format msg3(HUE_RESPONSE);
-        msg1%_server%_service%_uuid%st1;
-        msg2%_server%_service%_uuid%st2;
-        msg3%_server%_service%_uuid%st3;
-        _socket.send_to(buffer(msg1.str()), endpoint);
-        _socket.send_to(buffer(msg2.str()), endpoint);
-        _socket.send_to(buffer(msg3.str()), endpoint);
+            // The io thread is stuck, capture its backtrace
+            reported=true;
+            ++_stats.stalls;
+            _depth=0;
+            pthread_kill(_io_thread, _signal);
+            for (int i=0; i<100 && !_depth; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::cerr << "Event loop blocked for more than " << _threshold.count() << " ms at:" << std::endl;
+            backtrace_symbols_fd(_frames, _depth, STDERR_FILENO);
+        }
     }
-
 };
 
-/// SSDP Listener
-class Listener
-{
-private:
-    Responder &_resp;
-    ip::udp::socket _socket;
-    ip::udp::endpoint _sender_endpoint;
-    static const uint16_t _max_length=1024;
-    char _data[_max_length];
+const int Watchdog::_signal=SIGRTMIN;
+void *Watchdog::_frames[64];
+volatile sig_atomic_t Watchdog::_depth;
 
-public:
-    /**
-     * The constructor opens the SSDP port for listening, joins the multicast group and starts listening.
-     */
-    Listener(io_service &io_service, Responder &resp, const ip::address &listen_address,
-        const ip::address &multicast_address) :
-        _resp(resp), _socket(io_service)
-    {
-        // Create the socket so that multiple may be bound to the same address.
-        ip::udp::endpoint listen_endpoint(listen_address, multicast_port);
-        _socket.open(listen_endpoint.protocol());
-        _socket.set_option(ip::udp::socket::reuse_address(true));
-        _socket.bind(listen_endpoint);
-
-        // Join the multicast group.
-        _socket.set_option(ip::multicast::join_group(multicast_address));
-
-        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
-            boost::bind(&Listener::receive, this, placeholders::error,
-                placeholders::bytes_transferred));
-    }
+/// A bridge with a configured identity, see Responder::identity()
+struct StaticBridge
+{
+    std::string server;
+    std::string service;
+    std::string uuid;
+    std::string bridgeid;
+    std::string serial;
+    std::string name;
 
     /**
-     * Evaluates the received datagram.
+     * Parses "server:service,uuid=UUID[,bridgeid=ID][,serial=SN][,name=NAME]".
      *
-     * The function checks if the received datagram is a well formed "M-SEARCH" datagram, parses the data
-     * for sevice type ("ST:") and response timeout ("MX:") and checks, if the requested service type is
-     * a supported type for HUE bridge devices. If yes, then the function triggers a response to the same
-     * address and port the SSDP datagram was received on.
+     * The serial defaults to the last group of the UUID (the MAC address for real bridges), the bridge ID
+     * to the serial with FFFE inserted in the middle like real bridges do, and the name to "Philips hue".
      *
-     * @param error     If this error code says anything other than OK then the function returns immediately.
-     * @param bytes     Number of received bytes
+     * \throws std::invalid_argument if the server, the service or the UUID is missing.
      */
-    void receive(const boost::system::error_code &error, size_t bytes)
+    explicit StaticBridge(const std::string &s) : name("Philips hue")
     {
-        if (error) return;
-
-        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
-            boost::bind(&Listener::receive, this, placeholders::error,
-                placeholders::bytes_transferred));
-
-        const std::regex msearch("^M-SEARCH \\* HTTP/1\\.1");
-        const std::regex expr{"(\\S+):\\s(\\S+)"};
-        std::match_results<char*> what;
-
-        if (std::regex_search(_data, _data+bytes, what, msearch))
+        std::istringstream fields(s);
+        std::string field;
+        std::getline(fields, field, ',');
+        const size_t colon=field.find(':');
+        if (colon==std::string::npos) throw std::invalid_argument("Missing service in '"+s+"'");
+        server=field.substr(0, colon);
+        service=field.substr(colon+1);
+        while (std::getline(fields, field, ','))
         {
-            std::unordered_map<std::string, std::string> request;
-            for (char* start=what[0].second;
-                regex_search(start, _data+bytes, what, expr);
-                start=what[2].second) request[what[1]]=what[2];
+            const size_t eq=field.find('=');
+            const std::string key=field.substr(0, eq);
+            const std::string value=eq==std::string::npos ? std::string() : field.substr(eq+1);
+            if (key=="uuid") uuid=value;
+            else if (key=="bridgeid") bridgeid=value;
+            else if (key=="serial") serial=value;
+            else if (key=="name") name=value;
+            else throw std::invalid_argument("Unknown field '"+key+"' in '"+s+"'");
+        }
+        if (uuid.empty()) throw std::invalid_argument("Missing uuid in '"+s+"'");
+        if (serial.empty()) serial=uuid.substr(uuid.rfind('-')+1);
+        if (bridgeid.empty()) bridgeid=bridge_id(serial);
+    }
+};
 
-            // Is this a supported service type?
-            if (service_types.find(request["ST"])==service_types.end()) return;
+/// Daemon entry point, one program argument in the form "server:service" per bridge is required.
+int main(int argc, char *argv[])
+{
+    bool txtime=false;
+    clockid_t txclock=CLOCK_MONOTONIC;
+    uint32_t slack=0;
+    std::vector<std::pair<Subnet, uint32_t>> fast;
+    int busy_poll=0;
+    std::vector<std::pair<Subnet, std::string>> routes;
+    std::vector<Subnet> known;
+    size_t max_pending=1024;
+    uint32_t rate=0;
+    uint32_t watchdog=0;
+    size_t max_fetches=4;
+    std::string events;
+    std::string events_key;
+    std::vector<StaticBridge> statics;
+    std::string http_host;
+    uint16_t http_port=0;
+    std::vector<std::pair<std::string, std::string>> replicas;
+    uint32_t probe=5000;
+    std::string xdp;
+    bool mdns=false;
+    ip::udp::endpoint peers;
+    uint32_t peer_priority=100;
+    uint32_t heartbeat=1000;
+    uint32_t canary=0;
+    bool canary_fetch=false;
+    size_t farm=0;
+    std::string log;
+    uint32_t log_rate=100;
+    std::vector<std::pair<std::string, std::pair<std::string, uint16_t>>> proxies;
+    uint32_t coalesce=100;
+    uint32_t batch=0;
+    size_t upstream_window=4;
+    std::unique_ptr<StaticBridge> emulate;
+    std::vector<std::pair<std::string, Emulator::Type>> lights;
+    std::vector<std::pair<std::string, std::vector<size_t>>> groups;
+    std::string backend;
 
+    const option options[]=
+    {
+        {"txtime", optional_argument, nullptr, 't'},
+        {"slack", required_argument, nullptr, 's'},
+        {"fast", required_argument, nullptr, 'f'},
+        {"busy-poll", required_argument, nullptr, 'b'},
+        {"route", required_argument, nullptr, 'r'},
+        {"known", required_argument, nullptr, 'k'},
+        {"max-pending", required_argument, nullptr, 'p'},
+        {"rate", required_argument, nullptr, 'R'},
+        {"watchdog", required_argument, nullptr, 'w'},
+        {"max-fetches", required_argument, nullptr, 'F'},
+        {"events", required_argument, nullptr, 'e'},
+        {"events-key", required_argument, nullptr, 'K'},
+        {"static", required_argument, nullptr, 'S'},
+        {"http", required_argument, nullptr, 'H'},
+        {"replica", required_argument, nullptr, 'P'},
+        {"probe", required_argument, nullptr, 'T'},
+        {"xdp", required_argument, nullptr, 'X'},
+        {"mdns", no_argument, nullptr, 'M'},
+        {"peers", required_argument, nullptr, 'G'},
+        {"peer-priority", required_argument, nullptr, 'Q'},
+        {"heartbeat", required_argument, nullptr, 'B'},
+        {"canary", required_argument, nullptr, 'C'},
+        {"canary-fetch", no_argument, nullptr, 'c'},
+        {"farm", required_argument, nullptr, 'N'},
+        {"log", required_argument, nullptr, 'L'},
+        {"log-rate", required_argument, nullptr, 'l'},
+        {"proxy", required_argument, nullptr, 'x'},
+        {"coalesce", required_argument, nullptr, 'W'},
+        {"batch", required_argument, nullptr, 'A'},
+        {"upstream-window", required_argument, nullptr, 'U'},
+        {"emulate", required_argument, nullptr, 'E'},
+        {"light", required_argument, nullptr, 'I'},
+        {"group", required_argument, nullptr, 'g'},
+        {"backend", required_argument, nullptr, 'Y'},
+        {nullptr, 0, nullptr, 0}
+    };
+    for (int opt; (opt=getopt_long(argc, argv, "", options, nullptr))!=-1; )
+    {
+        switch (opt)
+        {
+        case 't':
+            txtime=true;
+            if (!optarg || strcmp(optarg, "monotonic")==0) txclock=CLOCK_MONOTONIC;
+            else if (strcmp(optarg, "tai")==0) txclock=CLOCK_TAI;
+            else
+            {
+                std::cerr << "Unknown launch time clock '" << optarg << "', use 'monotonic' or 'tai'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            try
+            {
+                slack=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The slack must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t at=arg.find('@');
+                fast.emplace_back(Subnet(arg.substr(0, at)),
+                    at==std::string::npos ? 0 : boost::lexical_cast<uint32_t>(arg.substr(at+1)));
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid fast subnet '" << optarg << "', use 'address/len[@ms]'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            try
+            {
+                busy_poll=boost::lexical_cast<int>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The busy poll time must be given in microseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t eq=arg.find('=');
+                if (eq==std::string::npos) throw std::invalid_argument(arg);
+                routes.emplace_back(Subnet(arg.substr(0, eq)), arg.substr(eq+1));
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid route '" << optarg << "', use 'address/len=server:service,...' or "
+                    "'address/len=deny'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            try
+            {
+                known.emplace_back(optarg);
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid known subnet '" << optarg << "', use 'address/len'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            try
+            {
+                max_pending=boost::lexical_cast<size_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The maximum number of pending responses must be a number." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            try
+            {
+                rate=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The rate must be given in telegrams per second." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            try
+            {
+                watchdog=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The watchdog threshold must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            try
+            {
+                max_fetches=boost::lexical_cast<size_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The maximum number of concurrent downloads must be a number." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            events=optarg;
+            break;
+        case 'K':
+            events_key=optarg;
+            break;
+        case 'S':
+            try
+            {
+                statics.emplace_back(optarg);
+            }
+            catch(const std::invalid_argument &e)
+            {
+                std::cerr << e.what() << ", use 'server:service,uuid=UUID[,bridgeid=ID][,serial=SN][,name=NAME]'."
+                    << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t colon=arg.rfind(':');
+                if (colon==std::string::npos) throw std::invalid_argument(arg);
+                http_host=arg.substr(0, colon);
+                http_port=boost::lexical_cast<uint16_t>(arg.substr(colon+1));
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid HTTP endpoint '" << optarg << "', use 'host:port'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+        {
+            const std::string arg(optarg);
+            const size_t eq=arg.find('=');
+            if (eq==std::string::npos || arg.find(':', eq)==std::string::npos)
+            {
+                std::cerr << "Invalid replica '" << optarg << "', use 'server:service=server:service'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            replicas.emplace_back(arg.substr(0, eq), arg.substr(eq+1));
+            break;
+        }
+        case 'T':
             try
             {
-                _resp(_sender_endpoint.address(), _sender_endpoint.port(), boost::lexical_cast<uint16_t>(request["MX"]));
+                probe=boost::lexical_cast<uint32_t>(optarg);
             }
             catch(const boost::bad_lexical_cast &)
             {
+                std::cerr << "The probe interval must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
             }
+            break;
+        case 'X':
+            xdp=optarg;
+            break;
+        case 'M':
+            mdns=true;
+            break;
+        case 'G':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t colon=arg.rfind(':');
+                if (colon==std::string::npos) throw std::invalid_argument(arg);
+                const std::string group=arg.front()=='[' && arg[colon-1]==']' ?
+                    arg.substr(1, colon-2) : arg.substr(0, colon);
+                peers=ip::udp::endpoint(ip::make_address(group), boost::lexical_cast<uint16_t>(arg.substr(colon+1)));
+                if (!peers.address().is_multicast()) throw std::invalid_argument(arg);
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid peer group '" << optarg << "', use 'multicast address:port'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'Q':
+            try
+            {
+                peer_priority=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The peer priority must be a number." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            try
+            {
+                heartbeat=boost::lexical_cast<uint32_t>(optarg);
+                if (!heartbeat) throw boost::bad_lexical_cast();
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The heartbeat interval must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            try
+            {
+                canary=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The canary interval must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            canary_fetch=true;
+            break;
+        case 'N':
+            try
+            {
+                farm=boost::lexical_cast<uint32_t>(optarg);
+                if (farm>1<<24) throw boost::bad_lexical_cast();
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The farm size must be a number up to 16777216." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            log=optarg;
+            if (log!="json" && log!="journal")
+            {
+                std::cerr << "Unknown log format '" << optarg << "', use 'json' or 'journal'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            try
+            {
+                log_rate=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The log rate must be given in events per second." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t eq=arg.find('='), colon=arg.rfind(':');
+                if (eq==std::string::npos || colon==std::string::npos || colon<eq) throw std::invalid_argument(arg);
+                proxies.emplace_back(arg.substr(0, eq), std::make_pair(arg.substr(eq+1, colon-eq-1),
+                    boost::lexical_cast<uint16_t>(arg.substr(colon+1))));
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid proxy '" << optarg << "', use 'server:service=host:port'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            try
+            {
+                coalesce=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The coalescing interval must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            try
+            {
+                batch=boost::lexical_cast<uint32_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The batch window must be given in milliseconds." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'U':
+            try
+            {
+                upstream_window=boost::lexical_cast<size_t>(optarg);
+            }
+            catch(const boost::bad_lexical_cast &)
+            {
+                std::cerr << "The upstream window must be a number of requests." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'E':
+            try
+            {
+                emulate.reset(new StaticBridge(optarg));
+                boost::lexical_cast<uint16_t>(emulate->service);
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid emulated bridge '" << optarg
+                    << "', use 'host:port,uuid=UUID[,bridgeid=ID][,serial=SN][,name=NAME]'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+        {
+            const std::string arg(optarg);
+            const size_t comma=arg.rfind(',');
+            const std::string type=comma==std::string::npos ? "color" : arg.substr(comma+1);
+            if (type!="dimmable" && type!="ct" && type!="color")
+            {
+                std::cerr << "Invalid light '" << optarg << "', use 'name[,dimmable|ct|color]'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            lights.emplace_back(arg.substr(0, comma), type=="dimmable" ? Emulator::type_dimmable :
+                type=="ct" ? Emulator::type_ct : Emulator::type_color);
+            break;
+        }
+        case 'g':
+            try
+            {
+                const std::string arg(optarg);
+                const size_t eq=arg.rfind('=');
+                if (eq==std::string::npos) throw std::invalid_argument(arg);
+                std::vector<size_t> ids;
+                std::istringstream fields(arg.substr(eq+1));
+                for (std::string id; std::getline(fields, id, ','); ) ids.push_back(boost::lexical_cast<size_t>(id));
+                if (ids.empty()) throw std::invalid_argument(arg);
+                groups.emplace_back(arg.substr(0, eq), ids);
+            }
+            catch(const std::exception &)
+            {
+                std::cerr << "Invalid group '" << optarg << "', use 'name=id,...'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'Y':
+            backend=optarg;
+            break;
+        default:
+            return EXIT_FAILURE;
         }
     }
-};
 
-/// Daemon entry point, one program argument in the form "server:service" is required.
-int main(int argc, char *argv[])
-{
-    if (argc!=2)
+    if (farm && !http_port)
+    {
+        std::cerr << "The farm needs --http to serve the description.xml of its bridges." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if ((!lights.empty() || !groups.empty() || !backend.empty()) && !emulate)
     {
-        std::cerr << "Exactly one parameter in the form 'server:service' is required." << std::endl;
+        std::cerr << "Lights, groups and a backend need --emulate." << std::endl;
         return EXIT_FAILURE;
     }
-    const std::string param(argv[1]);
-    const size_t colon=param.find_first_of(':');
-    if (colon==std::string::npos)
+    if (argc==optind && statics.empty() && !farm && !emulate)
     {
-        std::cerr << "Exactly one parameter in the form 'server:service' is required." << std::endl;
+        std::cerr << "At least one parameter in the form 'server:service' is required." << std::endl;
         return EXIT_FAILURE;
     }
+    for (int i=optind; i<argc; ++i)
+    {
+        if (!strchr(argv[i], ':'))
+        {
+            std::cerr << "Each bridge must be given in the form 'server:service'." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     try
     {
         io_service io_service;
-        Responder resp(io_service, param.substr(0, colon), param.substr(colon+1));
-        Listener rec(io_service, resp, ip::address::from_string("0.0.0.0"),
+        Statistics stats;
+        Router router;
+        Scheduler scheduler(stats);
+        scheduler.window(upstream_window);
+        Refresher refresher(io_service, scheduler, stats);
+        refresher.max_active(max_fetches);
+        refresher.slack(slack);
+        refresher.events(events, events_key);
+        std::unique_ptr<HttpServer> http;
+        if (http_port) http.reset(new HttpServer(io_service, http_port, stats));
+        std::unordered_map<std::string, std::unique_ptr<Responder>> bridges;
+        auto add=[&](const std::string &server, const std::string &service) -> Responder*
+            {
+                std::unique_ptr<Responder> &resp=bridges[server+":"+service];
+                if (resp) return nullptr;
+                resp.reset(new Responder(io_service, server, service, stats));
+                if (txtime && !resp->txtime(txclock))
+                    std::cerr << "No fq/etf qdisc or no SO_TXTIME support, using userspace timers." << std::endl;
+                resp->slack(slack);
+                resp->max_pending(max_pending);
+                for (const auto &f: fast) resp->fast(f.first, f.second);
+                router.add(*resp);
+                return resp.get();
+            };
+        // Serve the description.xml of static bridges ourselves, the UUID in the path tells the bridges apart
+        std::unordered_map<const Responder*, const StaticBridge*> described;
+        auto describe=[&](const Responder &resp)
+            {
+                const auto d=described.find(&resp);
+                if (d==described.end()) return;
+                const StaticBridge &b=*d->second;
+                http->document("/"+b.uuid+"/description.xml", "text/xml", (boost::format(HUE_DESCRIPTION)
+                    %resp.server()%resp.service()%b.name%b.serial%b.uuid).str());
+            };
+        for (const StaticBridge &b: statics)
+        {
+            Responder *resp=add(b.server, b.service);
+            if (!resp) continue;
+            resp->identity(b.uuid, b.bridgeid);
+            if (!http) continue;
+            described[resp]=&b;
+            describe(*resp);
+            resp->location(http_host, std::to_string(http_port), "/"+b.uuid+"/description.xml");
+        }
+        for (int i=optind; i<argc; ++i)
+        {
+            const std::string param(argv[i]);
+            const size_t colon=param.find_first_of(':');
+            Responder *resp=add(param.substr(0, colon), param.substr(colon+1));
+            if (resp) refresher.add(*resp);
+        }
+        std::unique_ptr<Emulator> emulator;
+        std::unique_ptr<Backend> emulator_backend;
+        if (emulate)
+        {
+            const StaticBridge &b=*emulate;
+            emulator.reset(new Emulator(io_service, b.server, boost::lexical_cast<uint16_t>(b.service), b.name,
+                b.serial, b.uuid, b.bridgeid, stats));
+            for (const auto &l: lights) emulator->light(l.first, l.second);
+            for (const auto &g: groups)
+            {
+                if (!emulator->group(g.first, g.second))
+                {
+                    std::cerr << "Group '" << g.first << "' of unknown lights." << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            if (!backend.empty())
+            {
+                try
+                {
+                    emulator_backend.reset(new Backend(io_service, backend, stats));
+                }
+                catch(const std::invalid_argument &e)
+                {
+                    std::cerr << e.what() << ", use 'exec:command', 'unix:path' or 'mqtt:host:port[/prefix]'."
+                        << std::endl;
+                    return EXIT_FAILURE;
+                }
+                emulator->backend(*emulator_backend);
+            }
+            Responder *resp=add(b.server, b.service);
+            if (resp) resp->identity(b.uuid, b.bridgeid);
+        }
+        for (const auto &r: routes)
+        {
+            std::vector<Responder*> advertised;
+            if (r.second!="deny")
+            {
+                std::istringstream names(r.second);
+                for (std::string name; std::getline(names, name, ','); )
+                {
+                    const auto b=bridges.find(name);
+                    if (b==bridges.end())
+                    {
+                        std::cerr << "Route to unknown bridge '" << name << "'." << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    advertised.push_back(b->second.get());
+                }
+            }
+            router.route(r.first, advertised);
+        }
+        Prober prober(io_service, scheduler, stats);
+        prober.interval(probe);
+        prober.on_switch([&](Responder &resp)
+            {
+                if (resp.is_static()) describe(resp);
+                else refresher.upstream(resp);
+            });
+        for (const auto &r: replicas)
+        {
+            const auto b=bridges.find(r.first);
+            if (b==bridges.end())
+            {
+                std::cerr << "Replica of unknown bridge '" << r.first << "'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            const size_t colon=r.second.rfind(':');
+            prober.replica(*b->second, r.second.substr(0, colon), r.second.substr(colon+1));
+        }
+        std::vector<std::unique_ptr<Proxy>> api_proxies;
+        for (const auto &p: proxies)
+        {
+            const auto b=bridges.find(p.first);
+            if (b==bridges.end())
+            {
+                std::cerr << "Proxy of unknown bridge '" << p.first << "'." << std::endl;
+                return EXIT_FAILURE;
+            }
+            api_proxies.emplace_back(new Proxy(io_service, *b->second, p.second.second, scheduler, stats));
+            api_proxies.back()->interval(coalesce);
+            api_proxies.back()->window(batch);
+            b->second->location(p.second.first, std::to_string(p.second.second), "/description.xml");
+        }
+        Admission admission(stats);
+        admission.rate(rate);
+        for (const Subnet &k: known) admission.known(k);
+        for (const auto &f: fast) admission.known(f.first);
+        Listener rec(io_service, router, admission, stats, ip::address::from_string("0.0.0.0"),
             ip::address::from_string("239.255.255.250"));
+        std::unique_ptr<Log> events_log;
+        if (!log.empty())
+        {
+            try
+            {
+                events_log.reset(new Log(log=="json" ? Log::format_json : Log::format_journal, log_rate,
+                    stats.log_dropped));
+            }
+            catch(const std::runtime_error &e)
+            {
+                std::cerr << "Logging to journald not possible (" << e.what() << "), using JSON on stdout." << std::endl;
+                events_log.reset(new Log(Log::format_json, log_rate, stats.log_dropped));
+            }
+            rec.log(*events_log);
+        }
+        std::unique_ptr<Farm> virtual_bridges;
+        if (farm)
+        {
+            virtual_bridges.reset(new Farm(io_service, farm, *http, http_host, http_port, stats));
+            rec.farm(*virtual_bridges);
+        }
+        if (busy_poll && !rec.busy_poll(busy_poll))
+            std::cerr << "SO_BUSY_POLL not permitted, waiting for interrupts." << std::endl;
+        std::unique_ptr<MdnsResponder> mdns_responder;
+        if (mdns) mdns_responder.reset(new MdnsResponder(io_service, router, admission, stats));
+        std::unique_ptr<Coordinator> coordinator;
+        signal_set term(io_service);
+        if (peers.port())
+        {
+            coordinator.reset(new Coordinator(io_service, stats, peers, peer_priority,
+                boost::posix_time::milliseconds(heartbeat)));
+            rec.coordinator(*coordinator);
+            if (events_log) coordinator->log(*events_log);
+            if (mdns_responder) mdns_responder->coordinator(*coordinator);
+            // Say goodbye on termination, so a standby takes over right away
+            term.add(SIGTERM);
+            term.add(SIGINT);
+            term.async_wait([&](const boost::system::error_code &e, int)
+                {
+                    if (e) return;
+                    coordinator->leave();
+                    io_service.stop();
+                });
+        }
+        if (!xdp.empty())
+        {
+            try
+            {
+                rec.xdp(xdp);
+            }
+            catch(const std::runtime_error &e)
+            {
+                std::cerr << "AF_XDP not available (" << e.what() << "), using the UDP socket." << std::endl;
+            }
+        }
+
+        signal_set usr1(io_service, SIGUSR1);
+        std::function<void(const boost::system::error_code &, int)> dump=
+            [&](const boost::system::error_code &e, int)
+            {
+                if (e) return;
+                ++stats.wakeups;
+                stats.print(std::cerr);
+                usr1.async_wait(dump);
+            };
+        usr1.async_wait(dump);
+
+        refresher.start();
+        prober.start();
+        std::unique_ptr<Canary> canary_probe;
+        if (canary)
+        {
+            canary_probe.reset(new Canary(io_service, stats, router, boost::posix_time::milliseconds(canary),
+                canary_fetch));
+            rec.canary(*canary_probe);
+        }
+
+        std::unique_ptr<Watchdog> dog;
+        if (watchdog) dog.reset(new Watchdog(io_service, stats, std::chrono::milliseconds(watchdog)));
+
         io_service.run();
     } catch (std::exception &e)
     {
@@ -0,0 +1,4770 @@
+/**
+ * @file hued.hpp
+ *
+ * Core of the HUE SSDP responder
+ *
+ * The responders, the listeners and the classes keeping the bridges up to date, shared by the hued daemon
+ * and the embeddable libhued library (see libhued.h). Everything runs on one io_service.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HUED_HPP
+#define HUED_HPP
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <boost/container/flat_map.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+#include <functional>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <cinttypes>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "classify.hpp"
+#include "http.hpp"
+#include "log.hpp"
+#include "lpm_trie.hpp"
+#include "xdp.hpp"
+
+using namespace boost::asio;
+
+const uint16_t multicast_port=1900; ///< Listen on this port for SSDP requests
+const uint16_t mdns_port=5353;  ///< Listen on this port for mDNS queries
+const uint16_t t_refresh=300; ///< Initial interval between two downloads of the description.xml in seconds
+const uint16_t t_refresh_min=5; ///< Shortest interval after a change or a failure in seconds
+const uint16_t t_refresh_max=3600; ///< Longest interval while the description.xml does not change in seconds
+const uint16_t t_download=10; ///< Abort downloads from the bridge after this many seconds
+const size_t max_event_line=65536; ///< Reconnect an event stream with a longer line in bytes
+const uint16_t t_event_idle=600; ///< Reconnect an event stream which was silent for this many seconds
+
+/**
+ * All three responses to an SSDP request are HUE_RESPONSE+HUE_LOCATION+HUE_SERVER+HUE_BRIDGEID followed by
+ * HUE_ST1, HUE_ST2 or HUE_ST3. The responses are sent as a gather list of these segments, see
+ * Responder::message().
+ */
+const char HUE_RESPONSE[] =
+  "HTTP/1.1 200 OK\r\n"
+  "HOST: 239.255.255.250:1900\r\n"
+  "CACHE-CONTROL: max-age=100\r\n"
+  "EXT:\r\n";
+/// The LOCATION of the description.xml, host, port and path
+const char HUE_LOCATION[] =
+  "LOCATION: http://%1%:%2%%3%\r\n";
+const char HUE_SERVER[] =
+  "SERVER: Linux/3.14.0 UPnP/1.0 IpBridge/1.24.0\r\n";  // was 1.17
+const char HUE_BRIDGEID[] =
+  "hue-bridgeid: %1%\r\n";
+/// The first SSDP response ends with HUE_ST1
+const char HUE_ST1[] =
+  "ST: upnp:rootdevice\r\n"
+  "USN: uuid:%1%::upnp:rootdevice\r\n"
+  "\r\n";
+/// The second SSDP response ends with HUE_ST2
+const char HUE_ST2[] =
+  "ST: uuid:%1%\r\n"
+  "USN: uuid:%1%\r\n"
+  "\r\n";
+/// The third SSDP response ends with HUE_ST3
+const char HUE_ST3[] =
+  "ST: urn:schemas-upnp-org:device:basic:1\r\n"
+  "USN: uuid:%1%\r\n"
+  "\r\n";
+/// The description.xml served for static bridges
+const char HUE_DESCRIPTION[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+  "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+  "<specVersion><major>1</major><minor>0</minor></specVersion>\n"
+  "<URLBase>http://%1%:%2%/</URLBase>\n"
+  "<device>\n"
+  "<deviceType>urn:schemas-upnp-org:device:Basic:1</deviceType>\n"
+  "<friendlyName>%3% (%1%)</friendlyName>\n"
+  "<manufacturer>Signify</manufacturer>\n"
+  "<manufacturerURL>http://www.philips-hue.com</manufacturerURL>\n"
+  "<modelDescription>Philips hue Personal Wireless Lighting</modelDescription>\n"
+  "<modelName>Philips hue bridge 2015</modelName>\n"
+  "<modelNumber>BSB002</modelNumber>\n"
+  "<modelURL>http://www.philips-hue.com</modelURL>\n"
+  "<serialNumber>%4%</serialNumber>\n"
+  "<UDN>uuid:%5%</UDN>\n"
+  "<presentationURL>index.html</presentationURL>\n"
+  "</device>\n"
+  "</root>\n";
+/// A list of service types to which hued responds. Those types can be found in the "ST:" field of the SSDP request.
+const std::unordered_set<std::string_view> service_types
+{
+    "urn:schemas-upnp-org:device:Basic:1",
+    "upnp:rootdevice",
+    "ssdpsearch:all",
+    "ssdp:all"
+};
+
+/// Counters of the daemon, written to stderr on SIGUSR1
+struct Statistics
+{
+    boost::posix_time::ptime started=boost::posix_time::second_clock::universal_time();
+    uint64_t searches=0;    ///< Valid M-SEARCH requests for a supported service type
+    uint64_t responses=0;   ///< Sent response telegrams
+    uint64_t denied=0;      ///< Searches from requesters routed to no bridge
+    uint64_t shed_known=0;  ///< Searches of known controllers dropped because of overload
+    uint64_t shed_unknown=0;    ///< Searches of unknown requesters dropped because of overload
+    uint64_t evicted=0;     ///< Queued responses dropped for a requester of a higher priority class
+    uint64_t wakeups=0;     ///< Handlers run by the io_service, i.e. times the daemon left its wait
+    uint64_t fetches=0;     ///< Downloads of description.xml
+    uint64_t fetch_errors=0;    ///< Failed downloads of description.xml
+    uint64_t fetch_changes=0;   ///< Downloads of a description.xml which differs from the previous one
+    uint64_t events=0;      ///< Server-sent events received from the bridges
+    uint64_t event_drops=0; ///< Lost event stream connections
+    uint64_t probes=0;      ///< Health probes of bridge replicas
+    uint64_t probe_errors=0;    ///< Failed health probes
+    uint64_t switches=0;    ///< Changes of the replica a bridge is advertised with
+    uint64_t xdp_frames=0;  ///< Frames received by the AF_XDP socket
+    uint64_t xdp_replies=0; ///< Response telegrams sent by the AF_XDP socket
+    uint64_t mdns_queries=0;    ///< mDNS queries for the _hue._tcp service or the names of a bridge
+    uint64_t mdns_answers=0;    ///< Sent mDNS answer packets
+    uint64_t mdns_suppressed=0; ///< mDNS answers suppressed by a known answer of the querier
+    uint64_t standby=0;     ///< Searches not answered because another instance leads
+    uint64_t takeovers=0;   ///< Times this instance became the leader
+    uint64_t canary_probes=0;   ///< Searches sent by the canary, one per interface and round
+    uint64_t canary_found=0;    ///< Canary searches which found a bridge in time
+    uint64_t canary_failures=0; ///< Canary searches which found no bridge in time
+    uint64_t canary_latency_sum=0;  ///< Sum of the discovery latencies of the canary in microseconds
+    uint64_t canary_latency_max=0;  ///< Longest discovery latency of the canary in microseconds
+    uint64_t log_dropped=0; ///< Log records lost because the log thread fell behind
+    uint64_t farm_fetches=0;    ///< Downloads of the description.xml of virtual bridges of the Farm
+    uint64_t farm_bridges_fetched=0;    ///< Virtual bridges whose description.xml was downloaded at least once
+    uint64_t proxy_requests=0;  ///< Requests received by the API proxies
+    uint64_t proxy_writes=0;    ///< Light state writes sent upstream by the API proxies
+    uint64_t proxy_coalesced=0; ///< Light state changes merged into a pending write
+    uint64_t proxy_errors=0;    ///< Failed upstream requests of the API proxies
+    uint64_t proxy_group_actions=0; ///< Group actions sent instead of the state changes of several lights
+    uint64_t proxy_batched=0;   ///< Light state changes sent as part of a group action
+    uint64_t upstream_queued=0; ///< Upstream requests which waited for a free slot of the Scheduler
+    uint64_t api_requests=0;    ///< Requests received by the API emulator
+    uint64_t api_changes=0;     ///< Light state changes applied by the API emulator
+    uint64_t backend_errors=0;  ///< State changes the backend failed to deliver
+    std::atomic<uint64_t> stalls{0};    ///< Stalls of the event loop detected by the Watchdog
+    std::atomic<uint64_t> stall_max{0}; ///< Longest stall of the event loop in milliseconds
+
+    /// Writes all counters and the average wakeups per minute since start.
+    void print(std::ostream &os) const
+    {
+        const long uptime=(boost::posix_time::second_clock::universal_time()-started).total_seconds();
+        os << "uptime=" << uptime << "s searches=" << searches << " responses=" << responses << " denied=" << denied
+            << " shed_known=" << shed_known << " shed_unknown=" << shed_unknown << " evicted=" << evicted
+            << " wakeups=" << wakeups << " wakeups/min=" << (uptime ? wakeups*60.0/uptime : 0.0)
+            << " stalls=" << stalls << " stall_max=" << stall_max << "ms"
+            << " fetches=" << fetches << " fetch_errors=" << fetch_errors << " fetch_changes=" << fetch_changes
+            << " events=" << events << " event_drops=" << event_drops
+            << " probes=" << probes << " probe_errors=" << probe_errors << " switches=" << switches
+            << " xdp_frames=" << xdp_frames << " xdp_replies=" << xdp_replies
+            << " mdns_queries=" << mdns_queries << " mdns_answers=" << mdns_answers
+            << " mdns_suppressed=" << mdns_suppressed << " standby=" << standby << " takeovers=" << takeovers
+            << " canary_probes=" << canary_probes << " canary_failures=" << canary_failures
+            << " canary_latency_avg=" << (canary_found ? canary_latency_sum/1000.0/canary_found : 0.0) << "ms"
+            << " canary_latency_max=" << canary_latency_max/1000.0 << "ms"
+            << " log_dropped=" << log_dropped << " farm_fetches=" << farm_fetches
+            << " farm_bridges_fetched=" << farm_bridges_fetched << " proxy_requests=" << proxy_requests
+            << " proxy_writes=" << proxy_writes << " proxy_coalesced=" << proxy_coalesced
+            << " proxy_errors=" << proxy_errors << " proxy_group_actions=" << proxy_group_actions
+            << " proxy_batched=" << proxy_batched << " upstream_queued=" << upstream_queued
+            << " api_requests=" << api_requests << " api_changes=" << api_changes
+            << " backend_errors=" << backend_errors << std::endl;
+    }
+};
+
+/// An IPv4 or IPv6 subnet in the form address/prefix length
+struct Subnet
+{
+    ip::address net;
+    unsigned len;
+
+    /**
+     * Parses a subnet in the form "address/len". Without "/len" the subnet is a single host.
+     *
+     * \throws std::invalid_argument if the address or the prefix length is invalid.
+     */
+    explicit Subnet(const std::string &s)
+    {
+        const size_t slash=s.find('/');
+        boost::system::error_code ec;
+        net=ip::make_address(s.substr(0, slash), ec);
+        if (ec) throw std::invalid_argument("Invalid address in subnet '"+s+"'");
+        const unsigned bits=net.is_v4() ? 32 : 128;
+        try
+        {
+            len=slash==std::string::npos ? bits : boost::lexical_cast<unsigned>(s.substr(slash+1));
+        }
+        catch(const boost::bad_lexical_cast &)
+        {
+            len=bits+1;
+        }
+        if (len>bits) throw std::invalid_argument("Invalid prefix length in subnet '"+s+"'");
+    }
+
+    /// Checks if addr is in this subnet.
+    bool contains(const ip::address &addr) const
+    {
+        if (addr.is_v4()!=net.is_v4()) return false;
+        if (addr.is_v4())
+        {
+            const uint32_t mask=len ? ~uint32_t(0)<<(32-len) : 0;
+            return ((addr.to_v4().to_uint()^net.to_v4().to_uint())&mask)==0;
+        }
+        const ip::address_v6::bytes_type a=addr.to_v6().to_bytes(), n=net.to_v6().to_bytes();
+        unsigned bits=len;
+        for (size_t i=0; bits; ++i)
+        {
+            const unsigned n_bits=bits<8 ? bits : 8;
+            const uint8_t mask=0xff<<(8-n_bits);
+            if ((a[i]^n[i])&mask) return false;
+            bits-=n_bits;
+        }
+        return true;
+    }
+};
+
+/**
+ * Finds the network interfaces with a qdisc which honours SCM_TXTIME launch times.
+ *
+ * The function dumps all qdiscs via rtnetlink and looks for "fq" (launch times on CLOCK_MONOTONIC) or
+ * "etf" (launch times on the clock configured for the qdisc, usually CLOCK_TAI). Other qdiscs silently
+ * ignore the launch time and send the datagram immediately, so only datagrams leaving through one of the
+ * found interfaces may be scheduled by the kernel (see egress_interface()).
+ *
+ * \param interfaces    Receives the indexes of the interfaces with an fq or etf qdisc
+ * \return              True if at least one fq or etf qdisc was found.
+ */
+inline bool launch_time_qdisc(std::unordered_set<int> &interfaces)
+{
+    const int fd=socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd<0) return false;
+
+    struct
+    {
+        nlmsghdr nh;
+        tcmsg tc;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len=sizeof(req);
+    req.nh.nlmsg_type=RTM_GETQDISC;
+    req.nh.nlmsg_flags=NLM_F_REQUEST|NLM_F_DUMP;
+    req.nh.nlmsg_seq=1;
+    req.tc.tcm_family=AF_UNSPEC;
+
+    interfaces.clear();
+    if (send(fd, &req, sizeof(req), 0)==sizeof(req))
+    {
+        alignas(nlmsghdr) char buf[16384];
+        for (bool done=false; !done; )
+        {
+            ssize_t len=recv(fd, buf, sizeof(buf), 0);
+            if (len<=0) break;
+            for (nlmsghdr *nh=reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nh, len); nh=NLMSG_NEXT(nh, len))
+            {
+                if (nh->nlmsg_type==NLMSG_DONE || nh->nlmsg_type==NLMSG_ERROR)
+                {
+                    done=true;
+                    break;
+                }
+                if (nh->nlmsg_type!=RTM_NEWQDISC) continue;
+                const tcmsg *tc=static_cast<const tcmsg*>(NLMSG_DATA(nh));
+                int alen=nh->nlmsg_len-NLMSG_LENGTH(sizeof(tcmsg));
+                for (rtattr *a=reinterpret_cast<rtattr*>(reinterpret_cast<char*>(NLMSG_DATA(nh))+
+                        NLMSG_ALIGN(sizeof(tcmsg))); RTA_OK(a, alen); a=RTA_NEXT(a, alen))
+                {
+                    if (a->rta_type!=TCA_KIND) continue;
+                    const char *kind=static_cast<const char*>(RTA_DATA(a));
+                    if (strcmp(kind, "fq")==0 || strcmp(kind, "etf")==0) interfaces.insert(tc->tcm_ifindex);
+                }
+            }
+        }
+    }
+    close(fd);
+    return !interfaces.empty();
+}
+
+/**
+ * Looks up the interface a datagram to dst leaves through by an rtnetlink route query.
+ *
+ * \return The interface index, 0 if there is no route.
+ */
+inline int egress_interface(const ip::address &dst)
+{
+    const int fd=socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd<0) return 0;
+
+    struct
+    {
+        nlmsghdr nh;
+        rtmsg rt;
+        char attrs[RTA_SPACE(16)];
+    } req;
+    memset(&req, 0, sizeof(req));
+    const size_t alen=dst.is_v4() ? 4 : 16;
+    req.nh.nlmsg_len=NLMSG_LENGTH(sizeof(rtmsg))+RTA_SPACE(alen);
+    req.nh.nlmsg_type=RTM_GETROUTE;
+    req.nh.nlmsg_flags=NLM_F_REQUEST;
+    req.nh.nlmsg_seq=1;
+    req.rt.rtm_family=dst.is_v4() ? AF_INET : AF_INET6;
+    req.rt.rtm_dst_len=alen*8;
+    rtattr *a=reinterpret_cast<rtattr*>(req.attrs);
+    a->rta_type=RTA_DST;
+    a->rta_len=RTA_LENGTH(alen);
+    if (dst.is_v4()) memcpy(RTA_DATA(a), dst.to_v4().to_bytes().data(), alen);
+    else memcpy(RTA_DATA(a), dst.to_v6().to_bytes().data(), alen);
+
+    int index=0;
+    alignas(nlmsghdr) char buf[4096];
+    ssize_t len;
+    if (send(fd, &req, req.nh.nlmsg_len, 0)==static_cast<ssize_t>(req.nh.nlmsg_len) &&
+        (len=recv(fd, buf, sizeof(buf), 0))>0)
+    {
+        for (nlmsghdr *nh=reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nh, len); nh=NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_type!=RTM_NEWROUTE) continue;
+            int rlen=RTM_PAYLOAD(nh);
+            for (rtattr *r=RTM_RTA(NLMSG_DATA(nh)); RTA_OK(r, rlen); r=RTA_NEXT(r, rlen))
+                if (r->rta_type==RTA_OIF) memcpy(&index, RTA_DATA(r), sizeof(index));
+        }
+    }
+    close(fd);
+    return index;
+}
+
+/// Priority classes of requesters under overload, higher classes are served first
+enum Priority
+{
+    prio_unknown,       ///< Any other requester
+    prio_learned,       ///< Controller which searched repeatedly before the overload, see Admission
+    prio_configured     ///< Controller in a subnet given by --known or --fast
+};
+
+/**
+ * Aligns a deadline to the power saving grid of slack milliseconds.
+ *
+ * The deadline is moved back to the previous grid point. If that is in the past, the next grid point
+ * is used instead, as long as it does not exceed the latest allowed time.
+ *
+ * \param deadline  The unaligned deadline
+ * \param now       The current time
+ * \param latest    The deadline must not be moved beyond this time
+ * \param slack     The grid in milliseconds, 0 disables the alignment
+ * \return          The aligned deadline, or the unaligned one if no grid point fits
+ */
+inline boost::posix_time::ptime align(boost::posix_time::ptime deadline, boost::posix_time::ptime now,
+    boost::posix_time::ptime latest, uint32_t slack)
+{
+    if (!slack) return deadline;
+
+    const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    const int64_t d=(deadline-epoch).total_milliseconds()/slack*slack;
+    boost::posix_time::ptime aligned=epoch+boost::posix_time::milliseconds(d);
+    if (aligned<now) aligned+=boost::posix_time::milliseconds(slack);
+    return aligned<=latest ? aligned : deadline;
+}
+
+/**
+ * Derives the bridge ID from the serial number like real bridges do, by inserting FFFE in the middle of
+ * the MAC address. Other serials are used as they are.
+ */
+inline std::string bridge_id(const std::string &serial)
+{
+    std::string id=serial.size()==12 ? serial.substr(0, 6)+"fffe"+serial.substr(6) : serial;
+    std::transform(id.begin(), id.end(), id.begin(), ::toupper);
+    return id;
+}
+
+/**
+ * Asynchronous download of a document by HTTP/1.0 GET, or any other HTTP/1.0 request by exchange().
+ *
+ * The object keeps itself alive by the shared pointers bound to its pending handlers, until the handler
+ * given to start() was called. The download is aborted after t_download seconds by default.
+ */
+class Download : public std::enable_shared_from_this<Download>
+{
+public:
+    /// Called with the error, or with the body of a response with status 200
+    typedef std::function<void(const boost::system::error_code &, const std::string &)> Handler;
+
+private:
+    ip::tcp::resolver _resolver;
+    ip::tcp::socket _socket;
+    deadline_timer _timeout;
+    streambuf _request;
+    streambuf _response;
+    Handler _handler;
+    bool _raw;          ///< Pass the whole response to the handler, whatever its status
+    bool _chunked;      ///< The body has the chunked transfer coding
+    bool _sized;        ///< The body has a Content-Length
+    uint64_t _length;
+    Statistics &_stats;
+
+    Download(io_service &io_service, Handler handler, bool raw, Statistics &stats) :
+        _resolver(io_service), _socket(io_service), _timeout(io_service), _handler(handler), _raw(raw),
+        _chunked(false), _sized(false), _length(0), _stats(stats)
+    {
+    }
+
+public:
+    /**
+     * Starts the download of http://server:service/path.
+     *
+     * \param handler   Called when the download is finished or failed
+     * \param timeout   The download is aborted after this time
+     */
+    static void start(io_service &io_service, const std::string &server, const std::string &service,
+        const std::string &path, Handler handler, Statistics &stats,
+        boost::posix_time::time_duration timeout=boost::posix_time::seconds(t_download))
+    {
+        std::shared_ptr<Download> d(new Download(io_service, handler, false, stats));
+
+        // Build a HTTP request for the document
+        std::ostream request_stream(&d->_request);
+        request_stream << "GET " << path << " HTTP/1.0\r\n";
+        request_stream << "Host: " << server << "\r\n";
+        request_stream << "Accept: */*\r\n";
+        request_stream << "Connection: close\r\n\r\n";
+        d->run(server, service, timeout);
+    }
+
+    /**
+     * Sends a complete HTTP/1.0 request to server:service and reads the response until the server closes
+     * the connection.
+     *
+     * \param request   The request including headers and body, should say "Connection: close"
+     * \param handler   Called with the error, or with the whole response including status line and headers
+     * \param timeout   The exchange is aborted after this time
+     */
+    static void exchange(io_service &io_service, const std::string &server, const std::string &service,
+        const std::string &request, Handler handler, Statistics &stats,
+        boost::posix_time::time_duration timeout=boost::posix_time::seconds(t_download))
+    {
+        std::shared_ptr<Download> d(new Download(io_service, handler, true, stats));
+        std::ostream(&d->_request) << request;
+        d->run(server, service, timeout);
+    }
+
+private:
+    void run(const std::string &server, const std::string &service, boost::posix_time::time_duration timeout)
+    {
+        _timeout.expires_from_now(timeout);
+        _timeout.async_wait(boost::bind(&Download::expired, shared_from_this(), placeholders::error));
+        _resolver.async_resolve(server, service,
+            boost::bind(&Download::resolved, shared_from_this(), placeholders::error, placeholders::results));
+    }
+
+    void expired(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        boost::system::error_code ignored;
+        _resolver.cancel();
+        _socket.close(ignored);
+    }
+
+    void resolved(const boost::system::error_code &e, const ip::tcp::resolver::results_type &endpoints)
+    {
+        ++_stats.wakeups;
+        if (e) return finish(e);
+        async_connect(_socket, endpoints, boost::bind(&Download::connected, shared_from_this(), placeholders::error));
+    }
+
+    void connected(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return finish(e);
+        async_write(_socket, _request, boost::bind(&Download::written, shared_from_this(), placeholders::error));
+    }
+
+    void written(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return finish(e);
+        if (_raw)
+            async_read(_socket, _response, transfer_all(),
+                boost::bind(&Download::body, shared_from_this(), placeholders::error));
+        else
+            async_read_until(_socket, _response, "\r\n\r\n",
+                boost::bind(&Download::header, shared_from_this(), placeholders::error));
+    }
+
+    /// Checks the status line and skips the response headers.
+    void header(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return finish(e);
+
+        // The head is parsed in the buffer, whose data is contiguous
+        HttpMessage m;
+        if (parse_response(static_cast<const char*>(_response.data().data()), _response.size(), m)!=http_complete ||
+            m.status!=200)
+            return finish(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        _response.consume(m.head);
+        _chunked=m.chunked;
+        _sized=m.has_length && !m.chunked;
+        _length=m.length;
+
+        // Read the given length, or until EOF
+        if (_sized)
+            async_read(_socket, _response, transfer_exactly(_length-std::min<uint64_t>(_length, _response.size())),
+                boost::bind(&Download::body, shared_from_this(), placeholders::error));
+        else
+            async_read(_socket, _response, transfer_all(),
+                boost::bind(&Download::body, shared_from_this(), placeholders::error));
+    }
+
+    void body(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e && e!=error::eof) return finish(e);
+        std::string body(buffers_begin(_response.data()), buffers_end(_response.data()));
+        size_t bytes=body.size();
+        if (_chunked && Dechunker().decode(&body[0], bytes)!=http_complete)
+            return finish(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        if (_sized && _length>bytes)
+            return finish(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        body.resize(_sized ? _length : bytes);
+        finish(boost::system::error_code(), body);
+    }
+
+    void finish(const boost::system::error_code &e, const std::string &body=std::string())
+    {
+        _timeout.cancel();
+        Handler handler;
+        handler.swap(_handler);
+        if (handler) handler(e, body);
+    }
+};
+
+/**
+ * Schedules the requests to the upstream servers by priority.
+ *
+ * Each server gets at most a window of requests at the same time, further requests wait in one queue per
+ * class and start in class order when a request finishes: interactive writes of controllers first, then
+ * their reads, then the background traffic of hued itself (description.xml refreshes and probes). The
+ * background may use all but one slot of the window, so a light switched by voice never waits for a slow
+ * poll to finish.
+ */
+class Scheduler
+{
+public:
+    enum Class
+    {
+        class_interactive,  ///< State changes of controllers
+        class_client,       ///< Other requests of controllers
+        class_background,   ///< Requests of hued itself
+        class_count
+    };
+    /// Ends a request and starts the next one, must be called exactly once
+    typedef std::function<void()> Done;
+    /// Starts a request when the scheduler lets it
+    typedef std::function<void(Done)> Job;
+
+private:
+    struct Upstream
+    {
+        std::array<std::deque<Job>, class_count> queues;
+        size_t active=0;
+        size_t background=0;    ///< Active requests of class_background
+    };
+    std::unordered_map<std::string, Upstream> _upstreams;
+    size_t _window;
+    Statistics &_stats;
+
+public:
+    Scheduler(Statistics &stats) : _window(4), _stats(stats)
+    {
+    }
+
+    /// Sets the number of simultaneous requests per server, 0 means no limit.
+    void window(size_t window)
+    {
+        _window=window;
+    }
+
+    /**
+     * Starts a request now or as soon as the window and the requests of higher classes allow.
+     *
+     * \param server    The host name or address of the server
+     * \param service   The port of the server
+     * \param job       Starts the request and calls the given Done when it is finished
+     */
+    void submit(const std::string &server, const std::string &service, Class cls, Job job)
+    {
+        const std::string key=server+":"+service;
+        Upstream &u=_upstreams[key];
+        u.queues[cls].push_back(job);
+        if (!dispatch(key, u)) ++_stats.upstream_queued;
+    }
+
+private:
+    /// Starts the waiting requests which fit into the window, returns false if some have to wait.
+    bool dispatch(const std::string &key, Upstream &u)
+    {
+        for (size_t c=0; c<class_count; ++c)
+        {
+            std::deque<Job> &queue=u.queues[c];
+            while (!queue.empty())
+            {
+                if (_window && u.active>=_window) return false;
+                const bool background=c==class_background;
+                if (background && _window>1 && u.background>=_window-1) return false;
+                Job job=std::move(queue.front());
+                queue.pop_front();
+                ++u.active;
+                if (background) ++u.background;
+                job([this, key, background]()
+                    {
+                        Upstream &u=_upstreams[key];
+                        --u.active;
+                        if (background) --u.background;
+                        dispatch(key, u);
+                    });
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Subscription to the server-sent events of a bridge.
+ *
+ * The stream is a long lived HTTP GET with "Accept: text/event-stream", like the /eventstream/clip/v2 of
+ * the Hue API v2 (behind a plain HTTP proxy, hued does not speak TLS) or a simple SSE endpoint of an
+ * emulator. Each complete event calls the event handler, the contents do not matter. When an established
+ * stream drops, the drop handler is called. The stream reconnects after a backoff of t_refresh_min seconds,
+ * which doubles up to t_refresh seconds while connecting fails. A stream silent for t_event_idle seconds is
+ * reconnected as well, so a half-open connection is noticed.
+ */
+class EventStream
+{
+public:
+    typedef std::function<void()> Handler;
+
+private:
+    std::string _server;
+    std::string _service;
+    std::string _path;
+    std::string _key;
+    ip::tcp::resolver _resolver;
+    ip::tcp::socket _socket;
+    deadline_timer _timer;
+    streambuf _request;
+    streambuf _response;
+    bool _chunked;  ///< The stream has the chunked transfer coding
+    Dechunker _dechunker;
+    std::string _text;  ///< The decoded stream behind the last complete line
+    bool _data;     ///< The current event has data
+    bool _connected;
+    boost::posix_time::ptime _received;     ///< Time of the last data on the established stream
+    boost::posix_time::time_duration _backoff;
+    Handler _on_connect;
+    Handler _on_event;
+    Handler _on_drop;
+    Statistics &_stats;
+
+public:
+    /**
+     * \param on_connect    Called when the stream was established
+     * \param on_event      Called for each event
+     * \param on_drop       Called when the established stream was lost
+     */
+    EventStream(io_service &io_service, const std::string &server, const std::string &service,
+        const std::string &path, const std::string &key, Handler on_connect, Handler on_event, Handler on_drop,
+        Statistics &stats) :
+        _server(server), _service(service), _path(path), _key(key), _resolver(io_service), _socket(io_service),
+        _timer(io_service), _chunked(false), _data(false), _connected(false),
+        _backoff(boost::posix_time::seconds(t_refresh_min)),
+        _on_connect(on_connect), _on_event(on_event), _on_drop(on_drop), _stats(stats)
+    {
+    }
+
+    /// Connects the stream.
+    void start()
+    {
+        request();
+        _timer.expires_from_now(boost::posix_time::seconds(t_download));
+        _timer.async_wait(boost::bind(&EventStream::expired, this, placeholders::error));
+        _resolver.async_resolve(_server, _service,
+            boost::bind(&EventStream::resolved, this, placeholders::error, placeholders::results));
+    }
+
+    /// Checks if the stream is established.
+    bool connected() const
+    {
+        return _connected;
+    }
+
+    /// Moves the stream to another server, a running connection is closed and reestablished there.
+    void target(const std::string &server, const std::string &service)
+    {
+        _server=server;
+        _service=service;
+        request();
+        boost::system::error_code ignored;
+        _resolver.cancel();
+        _socket.close(ignored);
+    }
+
+private:
+    /// Builds the subscription request for the current server.
+    void request()
+    {
+        _request.consume(_request.size());
+        std::ostream request_stream(&_request);
+        request_stream << "GET " << _path << " HTTP/1.1\r\n";
+        request_stream << "Host: " << _server << "\r\n";
+        request_stream << "Accept: text/event-stream\r\n";
+        if (!_key.empty()) request_stream << "hue-application-key: " << _key << "\r\n";
+        request_stream << "Cache-Control: no-cache\r\n\r\n";
+    }
+
+    /// Aborts a connection attempt which takes too long.
+    void expired(const boost::system::error_code &e)
+    {
+        if (e || _connected) return;
+        ++_stats.wakeups;
+        boost::system::error_code ignored;
+        _resolver.cancel();
+        _socket.close(ignored);
+    }
+
+    void resolved(const boost::system::error_code &e, const ip::tcp::resolver::results_type &endpoints)
+    {
+        ++_stats.wakeups;
+        if (e) return drop();
+        async_connect(_socket, endpoints, boost::bind(&EventStream::established, this, placeholders::error));
+    }
+
+    void established(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return drop();
+        _socket.set_option(socket_base::keep_alive(true));
+        async_write(_socket, _request.data(), boost::bind(&EventStream::written, this, placeholders::error));
+    }
+
+    void written(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return drop();
+        async_read_until(_socket, _response, "\r\n\r\n",
+            boost::bind(&EventStream::header, this, placeholders::error));
+    }
+
+    /// Checks the status line and skips the response headers.
+    void header(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return drop();
+
+        HttpMessage m;
+        if (parse_response(static_cast<const char*>(_response.data().data()), _response.size(), m)!=http_complete ||
+            m.status!=200)
+            return drop();
+        _response.consume(m.head);
+        _chunked=m.chunked;
+        _dechunker=Dechunker();
+
+        _connected=true;
+        _received=boost::posix_time::microsec_clock::universal_time();
+        _timer.expires_at(_received+boost::posix_time::seconds(t_event_idle));
+        _timer.async_wait(boost::bind(&EventStream::idle, this, placeholders::error));
+        _backoff=boost::posix_time::seconds(t_refresh_min);
+        _on_connect();
+        receive();
+    }
+
+    void read(const boost::system::error_code &e, size_t bytes)
+    {
+        ++_stats.wakeups;
+        if (e) return drop();
+        _received=boost::posix_time::microsec_clock::universal_time();
+        _response.commit(bytes);
+        receive();
+    }
+
+    /// Closes a stream which was silent for t_event_idle seconds, the failing read drops it.
+    void idle(const boost::system::error_code &e)
+    {
+        if (e || !_connected) return;
+        ++_stats.wakeups;
+        // The timer is not moved on each read, it is checked against the last data when it expires
+        const boost::posix_time::ptime deadline=_received+boost::posix_time::seconds(t_event_idle);
+        if (boost::posix_time::microsec_clock::universal_time()<deadline)
+        {
+            _timer.expires_at(deadline);
+            _timer.async_wait(boost::bind(&EventStream::idle, this, placeholders::error));
+            return;
+        }
+        boost::system::error_code ignored;
+        _socket.close(ignored);
+    }
+
+    /// Decodes the received part of the stream and parses its complete lines, an empty line ends an event.
+    void receive()
+    {
+        const size_t decoded=_text.size();
+        _text.append(buffers_begin(_response.data()), buffers_end(_response.data()));
+        _response.consume(_response.size());
+        if (_chunked)
+        {
+            size_t bytes=_text.size()-decoded;
+            const HttpResult result=_dechunker.decode(&_text[decoded], bytes);
+            _text.resize(decoded+bytes);
+            // The last chunk ends the stream like a closed connection
+            if (result!=http_incomplete) return drop();
+        }
+
+        size_t line=0;
+        for (size_t nl; (nl=_text.find('\n', line))!=std::string::npos; line=nl+1)
+        {
+            const size_t end=nl>line && _text[nl-1]=='\r' ? nl-1 : nl;
+            if (end==line)
+            {
+                if (_data)
+                {
+                    _data=false;
+                    ++_stats.events;
+                    _on_event();
+                }
+            }
+            else if (_text.compare(line, 5, "data:")==0) _data=true;
+        }
+        _text.erase(0, line);
+        if (_text.size()>max_event_line) return drop();
+
+        _socket.async_read_some(_response.prepare(4096),
+            boost::bind(&EventStream::read, this, placeholders::error, placeholders::bytes_transferred));
+    }
+
+    /// Closes the connection, reports the drop of an established stream and reconnects after the backoff.
+    void drop()
+    {
+        boost::system::error_code ignored;
+        _socket.close(ignored);
+        _response.consume(_response.size());
+        _text.clear();
+        _data=false;
+        if (_connected)
+        {
+            _connected=false;
+            ++_stats.event_drops;
+            _on_drop();
+        }
+
+        _timer.expires_from_now(_backoff);
+        _timer.async_wait(boost::bind(&EventStream::reconnect, this, placeholders::error));
+        _backoff=std::min(_backoff*2, boost::posix_time::time_duration(boost::posix_time::seconds(t_refresh)));
+    }
+
+    void reconnect(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        _timer.expires_from_now(boost::posix_time::seconds(t_download));
+        _timer.async_wait(boost::bind(&EventStream::expired, this, placeholders::error));
+        _resolver.async_resolve(_server, _service,
+            boost::bind(&EventStream::resolved, this, placeholders::error, placeholders::results));
+    }
+};
+
+/// Outcome of Responder::update()
+enum Update
+{
+    update_unchanged,   ///< The description.xml is the same as before
+    update_changed,     ///< The description.xml is new or differs from the previous one
+    update_failed,      ///< The download or the parser failed
+    update_refused      ///< The bridge refused or reset the connection, e.g. because it is restarting
+};
+
+/**
+ * Minimal HTTP/1.0 server for documents of hued, e.g. the description.xml of static bridges.
+ *
+ * Each connection serves one GET request and is closed afterwards.
+ */
+class HttpServer
+{
+public:
+    /// Generates the document at a path, returns false if there is none
+    typedef std::function<bool(const std::string &path, std::string &type, std::string &body)> Generator;
+
+private:
+    /// One connection, kept alive by the shared pointers bound to its handlers
+    class Session : public std::enable_shared_from_this<Session>
+    {
+    private:
+        HttpServer &_server;
+        ip::tcp::socket _socket;
+        streambuf _request;
+        std::string _response;
+
+    public:
+        Session(HttpServer &server, io_service &io_service) :
+            _server(server), _socket(io_service), _request(8192)
+        {
+        }
+
+        ip::tcp::socket &socket()
+        {
+            return _socket;
+        }
+
+        void start()
+        {
+            async_read_until(_socket, _request, "\r\n\r\n",
+                boost::bind(&Session::read, shared_from_this(), placeholders::error));
+        }
+
+    private:
+        void read(const boost::system::error_code &e)
+        {
+            ++_server._stats.wakeups;
+            if (e) return;
+
+            HttpMessage m;
+            const bool valid=parse_request(static_cast<const char*>(_request.data().data()), _request.size(), m)==
+                http_complete && m.method=="GET";
+            const std::string path(valid ? m.target : std::string_view());
+            const auto doc=_server._documents.find(path);
+            std::string type, body;
+            if (!valid)
+                _response="HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+            else if (doc==_server._documents.end() && !_server.generate(path, type, body))
+                _response="HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+            else
+            {
+                if (doc!=_server._documents.end())
+                {
+                    type=doc->second.first;
+                    body=doc->second.second;
+                }
+                _response="HTTP/1.0 200 OK\r\nContent-Type: "+type+"\r\nContent-Length: "+
+                    std::to_string(body.size())+"\r\nConnection: close\r\n\r\n"+body;
+            }
+            async_write(_socket, buffer(_response),
+                boost::bind(&Session::written, shared_from_this(), placeholders::error));
+        }
+
+        void written(const boost::system::error_code &)
+        {
+            ++_server._stats.wakeups;
+            boost::system::error_code ignored;
+            _socket.shutdown(ip::tcp::socket::shutdown_both, ignored);
+        }
+    };
+
+    io_service &_io_service;
+    ip::tcp::acceptor _acceptor;
+    std::unordered_map<std::string, std::pair<std::string, std::string>> _documents;
+    std::vector<std::pair<std::string, Generator>> _generators;
+    Statistics &_stats;
+
+public:
+    /// The constructor opens the TCP port and starts accepting.
+    HttpServer(io_service &io_service, uint16_t port, Statistics &stats) :
+        _io_service(io_service), _acceptor(io_service, ip::tcp::endpoint(ip::tcp::v4(), port)), _stats(stats)
+    {
+        accept();
+    }
+
+    /**
+     * Serves a document.
+     *
+     * \param path      The path of the document, e.g. "/description.xml"
+     * \param type      The content type
+     * \param body      The document
+     */
+    void document(const std::string &path, const std::string &type, const std::string &body)
+    {
+        _documents[path]=std::make_pair(type, body);
+    }
+
+    /**
+     * Serves the documents below a path prefix which are not given by document(), without storing them.
+     *
+     * \param prefix    The prefix of the paths, e.g. "/farm/"
+     * \param generator Called for each request of a path with this prefix
+     */
+    void generator(const std::string &prefix, Generator generator)
+    {
+        _generators.emplace_back(prefix, generator);
+    }
+
+private:
+    bool generate(const std::string &path, std::string &type, std::string &body) const
+    {
+        for (const auto &g: _generators)
+            if (path.compare(0, g.first.size(), g.first)==0 && g.second(path, type, body)) return true;
+        return false;
+    }
+
+    void accept()
+    {
+        std::shared_ptr<Session> session=std::make_shared<Session>(*this, _io_service);
+        _acceptor.async_accept(session->socket(),
+            boost::bind(&HttpServer::accepted, this, session, placeholders::error));
+    }
+
+    void accepted(std::shared_ptr<Session> session, const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (!e) session->start();
+        accept();
+    }
+};
+
+/// SSDP responder class
+class Responder
+{
+private:
+    io_service &_io_service;
+    std::string _server;
+    std::string _service;
+    std::string _uuid;
+    std::string _bridgeid;  ///< The hue-bridgeid, the UUID if empty
+    std::string _location_host;     ///< Host of the LOCATION, the server if empty
+    std::string _location_port;     ///< Port of the LOCATION
+    std::string _location_path;     ///< Path of the LOCATION
+    bool _static;   ///< The identity is configured, no downloads
+    std::string _location_line;     ///< The rendered #HUE_LOCATION
+    std::string _bridgeid_line;     ///< The rendered #HUE_BRIDGEID
+    std::array<std::string, 3> _st; ///< The rendered #HUE_ST1, #HUE_ST2 and #HUE_ST3
+    /// A response telegram as gather list, see message()
+    typedef std::array<const_buffer, 5> Message;
+    size_t _hash;   ///< Hash of the last description.xml
+    ip::udp::socket _socket;
+    deadline_timer _tresponse;
+    bool _txtime;
+    clockid_t _txclock;
+    std::unordered_set<int> _txtime_interfaces;     ///< Interfaces with a launch time qdisc
+    std::map<ip::address, bool> _txtime_routes;    ///< Requesters routed through one of them
+    uint32_t _slack;
+    /// A queued response
+    struct Pending
+    {
+        ip::udp::endpoint endpoint;
+        Priority prio;  ///< Only responses of lower classes may be evicted for this one
+        size_t first;   ///< The first telegram to send, the previous ones were given to the kernel already
+    };
+    /// Ordered by deadline, a flat map reserved for max_pending() entries never allocates when responding
+    boost::container::flat_multimap<boost::posix_time::ptime, Pending> _pending;
+    size_t _max_pending;
+    std::vector<std::pair<Subnet, uint32_t>> _fast;
+    Statistics &_stats;
+
+public:
+    /// The constructor opens the UDP response port.
+    Responder(io_service &io_service, const std::string &server, const std::string &service, Statistics &stats) :
+        _io_service(io_service), _server(server), _service(service), _uuid(), _location_path("/description.xml"),
+        _static(false), _hash(0), _socket(io_service), _tresponse(io_service),
+        _txtime(false), _txclock(CLOCK_MONOTONIC), _slack(0), _max_pending(1024), _stats(stats)
+    {
+        _socket.open(ip::udp::v4());
+        _pending.reserve(_max_pending);
+        render_location();
+    }
+
+    /// Limits the number of queued responses, see operator()().
+    void max_pending(size_t max_pending)
+    {
+        _max_pending=max_pending;
+        _pending.reserve(_max_pending);
+    }
+
+    /**
+     * Configures a fixed identity, so the bridge is never downloaded.
+     *
+     * \param uuid      The UUID of the bridge
+     * \param bridgeid  The hue-bridgeid of the SSDP responses
+     */
+    void identity(const std::string &uuid, const std::string &bridgeid)
+    {
+        _static=true;
+        _bridgeid=bridgeid;
+        this->uuid(uuid);
+    }
+
+    /// Checks if the identity is configured, see identity().
+    bool is_static() const
+    {
+        return _static;
+    }
+
+    /**
+     * Advertises another LOCATION than http://server:service/description.xml, e.g. the HttpServer of hued.
+     */
+    void location(const std::string &host, const std::string &port, const std::string &path)
+    {
+        _location_host=host;
+        _location_port=port;
+        _location_path=path;
+        render_location();
+    }
+
+    /**
+     * Enables the power saving mode.
+     *
+     * All response deadlines are aligned to multiples of slack milliseconds, so that they fall together
+     * and one wakeup serves all of them. The timer slack of the process is raised accordingly to let the
+     * kernel merge the remaining wakeups, too. See Refresher::slack() for the cache refreshes.
+     *
+     * \param slack     Grid of the deadlines in milliseconds, 0 disables the alignment.
+     */
+    void slack(uint32_t slack)
+    {
+        _slack=slack;
+        if (_slack) prctl(PR_SET_TIMERSLACK, static_cast<unsigned long>(_slack)*1000000UL);
+    }
+
+    /**
+     * Adds a subnet of trusted controllers, which get their responses after a fixed delay.
+     *
+     * The random delay within MX protects enumerators from a burst of responses of all devices in the
+     * subnet. Our own controllers do not need this and get the response right away or after the given
+     * fixed delay.
+     *
+     * \param subnet    The subnet of the controllers
+     * \param delay     The delay of the response in milliseconds, 0 responds before returning
+     */
+    void fast(const Subnet &subnet, uint32_t delay)
+    {
+        _fast.emplace_back(subnet, delay);
+    }
+
+    /**
+     * Switches to kernel scheduled responses.
+     *
+     * Instead of arming #_tresponse for each request the responses are sent immediately with an SCM_TXTIME
+     * launch time, so the fq or etf qdisc holds them back until the randomized MX deadline. If no such qdisc
+     * is installed or the kernel does not know SO_TXTIME the responder stays with the userspace timer.
+     * Requesters routed through an interface without such qdisc are answered by the timer as well.
+     *
+     * \param clock     The clock of the launch times, CLOCK_MONOTONIC for fq, CLOCK_TAI for etf.
+     * \return          True if kernel scheduling is active.
+     */
+    bool txtime(clockid_t clock)
+    {
+        if (!launch_time_qdisc(_txtime_interfaces)) return false;
+
+        sock_txtime cfg;
+        cfg.clockid=clock;
+        cfg.flags=SOF_TXTIME_REPORT_ERRORS;
+        if (setsockopt(_socket.native_handle(), SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg))<0) return false;
+
+        _txtime=true;
+        _txclock=clock;
+        _socket.async_wait(socket_base::wait_error,
+            boost::bind(&Responder::txtime_error, this, placeholders::error));
+        return true;
+    }
+
+    /**
+     * Update the UUID of the HUE bridge.
+     *
+     * For obtaining the UUID of the HUE bridge this function downloads the description.xml from the bridge
+     * asynchronously, parses this document and reads the UUID. The Refresher decides when to call it to
+     * prevent DOS to the HUE bridge.
+     *
+     * \param done      Called with the outcome, a description.xml which differs from the previous one is
+     *                  reported as update_changed
+     */
+    void update(std::function<void(Update)> done)
+    {
+        ++_stats.fetches;
+        Download::start(_io_service, _server, _service, "/description.xml",
+            [this, done](const boost::system::error_code &e, const std::string &body)
+            {
+                if (e)
+                {
+                    ++_stats.fetch_errors;
+                    std::cerr << "Download of description.xml from " << _server << ":" << _service << " failed: "
+                        << e.message() << std::endl;
+                    done(e==error::connection_refused || e==error::connection_reset ? update_refused : update_failed);
+                    return;
+                }
+
+                // The bridge description rarely changes, skip the parser then
+                const size_t hash=std::hash<std::string>()(body);
+                if (hash==_hash && ready())
+                {
+                    done(update_unchanged);
+                    return;
+                }
+                try
+                {
+                    // Create empty property tree object
+                    boost::property_tree::ptree tree;
+
+                    // Parse the XML into the property tree.
+                    std::istringstream xml(body);
+                    boost::property_tree::read_xml(xml, tree);
+
+                    std::string uuid=tree.get<std::string>("root.device.UDN");
+                    const std::string uu("uuid:");
+                    if (uuid.find(uu)==0)
+                    {
+                        this->uuid(uuid.substr(uu.length()));
+                    }
+                }
+                catch(const boost::property_tree::ptree_error &)
+                {
+                    ++_stats.fetch_errors;
+                    std::cerr << "Invalid description.xml from " << _server << ":" << _service << std::endl;
+                    done(update_failed);
+                    return;
+                }
+                _hash=hash;
+                ++_stats.fetch_changes;
+                done(update_changed);
+            }, _stats);
+    }
+
+    /**
+     * Moves the bridge to another replica, see Prober. The LOCATION of the responses and all further
+     * downloads use the new server.
+     */
+    void upstream(const std::string &server, const std::string &service)
+    {
+        _server=server;
+        _service=service;
+        render_location();
+    }
+
+    /// The host name or address of the bridge
+    const std::string &server() const
+    {
+        return _server;
+    }
+
+    /// The port of the bridge
+    const std::string &service() const
+    {
+        return _service;
+    }
+
+    /// The UUID of the bridge, empty until it is known
+    const std::string &uuid() const
+    {
+        return _uuid;
+    }
+
+    /// The configured hue-bridgeid, empty if it is the UUID
+    const std::string &bridgeid() const
+    {
+        return _bridgeid;
+    }
+
+    /// Checks if the UUID of the bridge is known, i.e. hued can respond for this bridge.
+    bool ready() const
+    {
+        return !_uuid.empty();
+    }
+
+    /**
+     * Starts the SSID response.
+     *
+     * If the UUID of the HUE bridge is not known yet, the function returns immediately. Otherwise it queues
+     * the response for a deadline between 0 and a (pseudo) random time given by mx (in seconds), when respond() sends
+     * it. This mechanism reduces the DDOS problem for the enumerating device when each enumerated device
+     * in the subnet answers to the same request. Controllers in a subnet added by fast() get a fixed delay.
+     *
+     * If the queue already holds max_pending() responses, the new response replaces the latest queued
+     * response of the lowest priority class below its own, otherwise the search is shed.
+     *
+     * \param addr      The address to respond to (HUE bridge)
+     * \param port      The port to respond to (HUE bridge)
+     * \param mx        An interval in seconds, in which the response should be sent.
+     * \param prio      The priority class of the requester, see Admission.
+     * \param direct    The AF_XDP socket the search was received on, immediate responses are sent through
+     *                  its TX ring
+     */
+    void operator()(ip::address addr, uint16_t port, uint16_t mx, Priority prio, XdpSocket *direct=nullptr)
+    {
+        if (!ready()) return;
+
+        const auto fast=std::find_if(_fast.begin(), _fast.end(),
+            [&](const std::pair<Subnet, uint32_t> &f) { return f.first.contains(addr); });
+        if (fast!=_fast.end() && fast->second==0)
+        {
+            const ip::udp::endpoint endpoint(addr, port);
+            for (size_t i=0; i<_st.size(); ++i)
+            {
+                iovec iov[std::tuple_size<Message>::value];
+                if (direct && direct->reply(gather(message(i), iov), std::tuple_size<Message>::value))
+                    ++_stats.xdp_replies;
+                else
+                    _socket.send_to(message(i), endpoint);
+            }
+            _stats.responses+=_st.size();
+            return;
+        }
+
+        uint32_t t_response=fast!=_fast.end() ? fast->second : static_cast<uint64_t>(mx)*1000*rand()/RAND_MAX;
+        const size_t first=_txtime && txtime_route(addr) ? respond_at(ip::udp::endpoint(addr, port), t_response) : 0;
+        if (first==_st.size()) return;
+
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        const boost::posix_time::ptime deadline=fast!=_fast.end() ? now+boost::posix_time::milliseconds(t_response) :
+            align(now+boost::posix_time::milliseconds(t_response), now, now+boost::posix_time::seconds(mx), _slack);
+
+        if (_pending.size()>=_max_pending)
+        {
+            auto victim=_pending.rend();
+            for (auto p=_pending.rbegin(); p!=_pending.rend(); ++p)
+                if (p->second.prio<prio && (victim==_pending.rend() || p->second.prio<victim->second.prio))
+                    victim=p;
+            if (victim==_pending.rend())
+            {
+                ++(prio==prio_unknown ? _stats.shed_unknown : _stats.shed_known);
+                return;
+            }
+            _pending.erase(std::next(victim).base());
+            ++_stats.evicted;
+        }
+
+        // Only a new earliest deadline needs to rearm the timer
+        const auto queued=_pending.emplace(deadline, Pending{ip::udp::endpoint(addr, port), prio, first});
+        if (queued!=_pending.begin()) return;
+        _tresponse.expires_at(deadline);
+        _tresponse.async_wait(boost::bind(&Responder::respond, this, placeholders::error));
+    }
+
+private:
+    /**
+     * Sends three response telegrams (see message()) to every queued
+     * endpoint whose deadline has passed and rearms the timer for the next one.
+     *
+     * \param e     If this async timer error code says something other than OK the fuction returns
+     *                  immediately.
+     */
+    void respond(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        auto due=_pending.begin();
+        for (; due!=_pending.end() && due->first<=now; ++due)
+        {
+            for (size_t i=due->second.first; i<_st.size(); ++i)
+                _socket.send_to(message(i), due->second.endpoint);
+            _stats.responses+=_st.size()-due->second.first;
+        }
+        _pending.erase(_pending.begin(), due);
+
+        if (_pending.empty()) return;
+        _tresponse.expires_at(_pending.begin()->first);
+        _tresponse.async_wait(boost::bind(&Responder::respond, this, placeholders::error));
+    }
+
+    /// Sets the UUID and renders the segments depending on it, if it changed.
+    void uuid(const std::string &uuid)
+    {
+        if (uuid==_uuid) return;
+        _uuid=uuid;
+        render_uuid();
+    }
+
+    /// Formats #_location_line, so responding needs no formatting nor allocation.
+    void render_location()
+    {
+        const std::string &host=_location_host.empty() ? _server : _location_host;
+        const std::string &port=_location_host.empty() ? _service : _location_port;
+        _location_line=(boost::format(HUE_LOCATION)%host%port%_location_path).str();
+    }
+
+    /// Formats #_bridgeid_line and #_st from the UUID.
+    void render_uuid()
+    {
+        _bridgeid_line=(boost::format(HUE_BRIDGEID)%(_bridgeid.empty() ? _uuid : _bridgeid)).str();
+        _st={(boost::format(HUE_ST1)%_uuid).str(), (boost::format(HUE_ST2)%_uuid).str(),
+            (boost::format(HUE_ST3)%_uuid).str()};
+    }
+
+    /**
+     * Returns the response telegram i (0..2) as gather list of the shared constant segments and the
+     * rendered segments of this bridge. The segments are only rendered when the LOCATION or the UUID
+     * changes, so a change rewrites one short line instead of all telegrams.
+     */
+    Message message(size_t i) const
+    {
+        return {buffer(HUE_RESPONSE, sizeof(HUE_RESPONSE)-1), buffer(_location_line),
+            buffer(HUE_SERVER, sizeof(HUE_SERVER)-1), buffer(_bridgeid_line), buffer(_st[i])};
+    }
+
+    /// Converts a telegram to the iovec array iov for sendmsg() and returns iov.
+    static const iovec *gather(const Message &msg, iovec *iov)
+    {
+        for (size_t j=0; j<msg.size(); ++j)
+        {
+            iov[j].iov_base=const_cast<void*>(msg[j].data());
+            iov[j].iov_len=msg[j].size();
+        }
+        return iov;
+    }
+
+    /// Checks if responses to addr leave through an interface with a launch time qdisc.
+    bool txtime_route(const ip::address &addr)
+    {
+        const auto known=_txtime_routes.find(addr);
+        if (known!=_txtime_routes.end()) return known->second;
+        // Controllers are few, the cache is only bounded against spoofed requesters
+        if (_txtime_routes.size()>=_max_pending) _txtime_routes.clear();
+        return _txtime_routes[addr]=_txtime_interfaces.count(egress_interface(addr))>0;
+    }
+
+    /**
+     * Sends the three response telegrams immediately with a launch time of now+delay.
+     *
+     * A transient failure like ENOBUFS stops at the failed telegram, only EINVAL and EOPNOTSUPP, i.e. no
+     * launch time support, switch back to the userspace timer for good.
+     *
+     * \param endpoint  The address and port of the SSDP enumerator
+     * \param delay     The delay in milliseconds until the qdisc releases the datagrams
+     * \return          The number of telegrams given to the kernel, the caller has to send the remaining
+     *                  ones by the timer.
+     */
+    size_t respond_at(ip::udp::endpoint endpoint, uint32_t delay)
+    {
+        timespec now;
+        clock_gettime(_txclock, &now);
+        const uint64_t launch=(static_cast<uint64_t>(now.tv_sec)*1000000000+now.tv_nsec)+
+            static_cast<uint64_t>(delay)*1000000;
+
+        for (size_t i=0; i<_st.size(); ++i)
+        {
+            iovec iov[std::tuple_size<Message>::value];
+            gather(message(i), iov);
+
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(launch))];
+            memset(control, 0, sizeof(control));
+            msghdr hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name=endpoint.data();
+            hdr.msg_namelen=endpoint.size();
+            hdr.msg_iov=iov;
+            hdr.msg_iovlen=std::tuple_size<Message>::value;
+            hdr.msg_control=control;
+            hdr.msg_controllen=sizeof(control);
+
+            cmsghdr *cm=CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level=SOL_SOCKET;
+            cm->cmsg_type=SCM_TXTIME;
+            cm->cmsg_len=CMSG_LEN(sizeof(launch));
+            memcpy(CMSG_DATA(cm), &launch, sizeof(launch));
+
+            if (sendmsg(_socket.native_handle(), &hdr, 0)<0)
+            {
+                if (errno==EINVAL || errno==EOPNOTSUPP) _txtime=false;
+                _stats.responses+=i;
+                return i;
+            }
+        }
+        _stats.responses+=_st.size();
+        return _st.size();
+    }
+
+    /**
+     * Drains the socket error queue and falls back to the userspace timer if the qdisc rejected a launch time.
+     *
+     * \param e     If this async wait error code says something other than OK the function returns
+     *                  immediately.
+     */
+    void txtime_error(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err)+sizeof(sockaddr_in))];
+        char data[1];
+        iovec iov;
+        iov.iov_base=data;
+        iov.iov_len=sizeof(data);
+        msghdr hdr;
+        for (;;)
+        {
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_iov=&iov;
+            hdr.msg_iovlen=1;
+            hdr.msg_control=control;
+            hdr.msg_controllen=sizeof(control);
+            if (recvmsg(_socket.native_handle(), &hdr, MSG_ERRQUEUE|MSG_DONTWAIT)<0) break;
+            for (cmsghdr *cm=CMSG_FIRSTHDR(&hdr); cm; cm=CMSG_NXTHDR(&hdr, cm))
+            {
+                const sock_extended_err *ee=reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+                if (cm->cmsg_level==SOL_IP && cm->cmsg_type==IP_RECVERR && ee->ee_origin==SO_EE_ORIGIN_TXTIME
+                    && _txtime)
+                {
+                    _txtime=false;
+                    std::cerr << "Launch time rejected by qdisc, falling back to userspace timers." << std::endl;
+                }
+            }
+        }
+
+        if (_txtime)
+            _socket.async_wait(socket_base::wait_error,
+                boost::bind(&Responder::txtime_error, this, placeholders::error));
+    }
+
+};
+
+/**
+ * Schedules the downloads of description.xml for all bridges.
+ *
+ * With one fixed refresh interval per bridge, bridges started together would be refreshed in the same
+ * instant forever. The refresher gives each bridge its own phase within the interval, so the downloads are
+ * spread evenly, and moves each download by a random jitter of up to a quarter of the distance between
+ * two phases. The phases are kept relative to the start, so the jitter does not accumulate. At most
+ * max_active() downloads run at the same time, further due bridges wait for a free slot.
+ *
+ * The interval of each bridge adapts to its changes: it doubles up to t_refresh_max seconds while the
+ * description.xml stays the same, and drops to t_refresh_min seconds when it changed or when the bridge
+ * refused the connection, e.g. while an emulator is redeployed. Other failures divide the interval by 8.
+ * So a stable bridge is rarely downloaded, but a new UUID is seen within seconds after a redeploy.
+ *
+ * With events() each bridge gets an EventStream. An event downloads the description.xml right away, but at
+ * most one download per t_refresh_min seconds starts for events, because a Hue v2 event stream reports
+ * every light and sensor update. While the stream is connected polling is only a fallback every
+ * t_refresh_max seconds. When the stream
+ * drops, the bridge is downloaded immediately, because the drop may be a redeploy, and polling continues
+ * with the adaptive interval until the stream is back.
+ */
+class Refresher
+{
+private:
+    struct Bridge
+    {
+        Responder *resp;
+        boost::posix_time::time_duration interval;  ///< Time between two downloads
+        boost::posix_time::ptime base;              ///< Start of the current interval sequence
+        boost::posix_time::time_duration phase;     ///< Offset of the downloads of this bridge within the interval
+        boost::posix_time::ptime next;              ///< Time of the next download
+        bool active;                                ///< The download is running
+        bool again;                                 ///< The bridge was invalidated during the running download
+        bool event;                                 ///< An event arrived during the running download
+        boost::posix_time::ptime started;           ///< Start of the last download
+        std::unique_ptr<EventStream> events;
+    };
+    io_service &_io_service;
+    deadline_timer _timer;
+    std::vector<Bridge> _bridges;
+    size_t _max_active;
+    size_t _active;
+    uint32_t _slack;
+    std::string _events;
+    std::string _events_key;
+    Scheduler &_scheduler;
+    Statistics &_stats;
+
+public:
+    Refresher(io_service &io_service, Scheduler &scheduler, Statistics &stats) :
+        _io_service(io_service), _timer(io_service), _max_active(4), _active(0), _slack(0), _scheduler(scheduler),
+        _stats(stats)
+    {
+    }
+
+    /// Adds a bridge, its first download starts with start().
+    void add(Responder &resp)
+    {
+        _bridges.push_back(Bridge{&resp, boost::posix_time::seconds(t_refresh), boost::posix_time::ptime(),
+            boost::posix_time::seconds(0), boost::posix_time::ptime(), false, false, false, boost::posix_time::ptime(),
+            nullptr});
+    }
+
+    /// Limits the number of concurrent downloads.
+    void max_active(size_t max_active)
+    {
+        _max_active=max_active ? max_active : 1;
+    }
+
+    /// Aligns the downloads to the power saving grid of slack milliseconds, see Responder::slack().
+    void slack(uint32_t slack)
+    {
+        _slack=slack;
+    }
+
+    /**
+     * Subscribes to the server-sent events of all bridges with start().
+     *
+     * \param path      The path of the event stream on the bridges, e.g. "/eventstream/clip/v2"
+     * \param key       The hue-application-key, empty for none
+     */
+    void events(const std::string &path, const std::string &key)
+    {
+        _events=path;
+        _events_key=key;
+    }
+
+    /// Assigns the phases and starts the first download and the event streams of all bridges.
+    void start()
+    {
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        for (size_t i=0; i<_bridges.size(); ++i)
+        {
+            Bridge &b=_bridges[i];
+            b.base=now;
+            b.phase=b.interval*i/_bridges.size();
+            b.next=now;
+            if (_events.empty()) continue;
+            b.events.reset(new EventStream(_io_service, b.resp->server(), b.resp->service(), _events, _events_key,
+                [this, i]() { interval(_bridges[i], boost::posix_time::seconds(t_refresh_max)); },
+                [this, i]() { event(i); },
+                [this, i]() { interval(_bridges[i], boost::posix_time::seconds(t_refresh_min)); invalidate(i); },
+                _stats));
+            b.events->start();
+        }
+        expired(boost::system::error_code());
+    }
+
+    /// Downloads the description.xml of bridge i as soon as a download slot is free.
+    void invalidate(size_t i)
+    {
+        Bridge &b=_bridges[i];
+        if (b.active)
+        {
+            b.again=true;
+            return;
+        }
+        b.next=boost::posix_time::microsec_clock::universal_time();
+        schedule();
+    }
+
+    /// Handles an event of bridge i, the download starts at the earliest t_refresh_min seconds after the last one.
+    void event(size_t i)
+    {
+        Bridge &b=_bridges[i];
+        if (b.active)
+        {
+            b.event=true;
+            return;
+        }
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        b.next=std::min(b.next, std::max(now, b.started+boost::posix_time::seconds(t_refresh_min)));
+        schedule();
+    }
+
+    /// Follows a bridge to another replica, see Prober. The new replica is downloaded right away.
+    void upstream(const Responder &resp)
+    {
+        for (size_t i=0; i<_bridges.size(); ++i)
+        {
+            if (_bridges[i].resp!=&resp) continue;
+            if (_bridges[i].events) _bridges[i].events->target(resp.server(), resp.service());
+            invalidate(i);
+        }
+    }
+
+private:
+    /**
+     * Calculates the next download of a bridge, i.e. the next time after now at its phase plus jitter.
+     */
+    boost::posix_time::ptime next(const Bridge &b, boost::posix_time::ptime now) const
+    {
+        const int64_t interval=b.interval.total_milliseconds();
+        const int64_t since=(now-b.base-b.phase).total_milliseconds();
+        const int64_t k=since<0 ? 0 : since/interval+1;
+        const int64_t spread=interval/_bridges.size()/4;
+        const int64_t jitter=spread ? static_cast<int64_t>(rand()%(2*spread+1))-spread : 0;
+        const boost::posix_time::ptime t=b.base+b.phase+boost::posix_time::milliseconds(k*interval+jitter);
+        return align(t<now ? now : t, now, boost::posix_time::pos_infin, _slack);
+    }
+
+    /// Sets the interval of a bridge, a new interval starts a new sequence at now keeping the phase.
+    void interval(Bridge &b, boost::posix_time::time_duration interval)
+    {
+        if (interval==b.interval) return;
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        b.interval=interval;
+        b.base=now-b.phase;
+        if (!b.active && b.resp->ready()) b.next=next(b, now);
+    }
+
+    /// Arms the timer for the earliest waiting bridge, if a download slot is free.
+    void schedule()
+    {
+        if (_active>=_max_active) return;
+        const Bridge *first=nullptr;
+        for (const Bridge &b: _bridges)
+            if (!b.active && (!first || b.next<first->next)) first=&b;
+        if (!first) return;
+        _timer.expires_at(first->next);
+        _timer.async_wait(boost::bind(&Refresher::expired, this, placeholders::error));
+    }
+
+    /// Starts the downloads of all due bridges, the longest waiting first, as long as slots are free.
+    void expired(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        while (_active<_max_active)
+        {
+            Bridge *due=nullptr;
+            for (Bridge &b: _bridges)
+                if (!b.active && b.next<=now && (!due || b.next<due->next)) due=&b;
+            if (!due) break;
+
+            due->active=true;
+            due->started=now;
+            ++_active;
+            const size_t i=due-_bridges.data();
+            Responder *resp=due->resp;
+            _scheduler.submit(resp->server(), resp->service(), Scheduler::class_background,
+                [this, i, resp](Scheduler::Done finished)
+                {
+                    resp->update([this, i, finished](Update u) { finished(); done(i, u); });
+                });
+        }
+        schedule();
+    }
+
+    /// Called when the download of bridge i is finished.
+    void done(size_t i, Update u)
+    {
+        Bridge &b=_bridges[i];
+        b.active=false;
+        --_active;
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+
+        boost::posix_time::time_duration interval;
+        switch (u)
+        {
+        case update_unchanged:
+            interval=std::min(b.interval*2, boost::posix_time::time_duration(boost::posix_time::seconds(t_refresh_max)));
+            break;
+        case update_failed:
+            interval=b.interval/8;
+            break;
+        default:
+            interval=boost::posix_time::seconds(t_refresh_min);
+        }
+        interval=std::max(interval, boost::posix_time::time_duration(boost::posix_time::seconds(t_refresh_min)));
+
+        // With a connected event stream polling is only the fallback
+        if (b.events && b.events->connected() && (u==update_unchanged || u==update_changed))
+            interval=boost::posix_time::seconds(t_refresh_max);
+
+        this->interval(b, interval);
+        b.next=b.again ? now : next(b, now);
+        if (b.event) b.next=std::min(b.next, std::max(now, b.started+boost::posix_time::seconds(t_refresh_min)));
+        b.again=false;
+        b.event=false;
+        schedule();
+    }
+};
+
+/**
+ * Selects the replica a bridge is advertised with, if the bridge runs as several replicas sharing one
+ * identity, e.g. two HA-Bridge instances for failover.
+ *
+ * Every probe interval each replica is probed by a download of its description.xml, which is aborted after
+ * half the interval. The round trip time and the success rate of the probes are kept as moving averages.
+ * A bridge uses the replica with the lowest round trip time per success rate among the replicas whose last
+ * probe succeeded. The active replica is probed every half interval and replaced as soon as one of its probes
+ * fails, so a failure is followed within one probe interval: at most half an interval until the next probe
+ * starts plus half an interval until it times out. A healthy replica is only replaced by one which is better
+ * by a quarter and at least a millisecond, so the LOCATION does not flap between replicas of similar latency.
+ */
+class Prober
+{
+public:
+    /// Called after a bridge was moved to another replica
+    typedef std::function<void(Responder &)> Handler;
+
+private:
+    struct Replica
+    {
+        std::string server;
+        std::string service;
+        double rtt;         ///< Moving average of the round trip time in milliseconds, negative before the first success
+        double success;     ///< Moving average of the probe outcomes, 1 for success and 0 for failure
+        bool up;            ///< The last probe succeeded, or no probe finished yet
+        bool probing;       ///< The probe is running
+    };
+    struct Bridge
+    {
+        Responder *resp;
+        std::vector<Replica> replicas;
+        size_t active;      ///< The replica the bridge is advertised with
+    };
+    io_service &_io_service;
+    deadline_timer _timer;
+    boost::posix_time::time_duration _interval;
+    uint64_t _round;        ///< Counts the half intervals, the inactive replicas are probed in the even ones
+    std::vector<Bridge> _bridges;
+    Handler _on_switch;
+    Scheduler &_scheduler;
+    Statistics &_stats;
+
+public:
+    Prober(io_service &io_service, Scheduler &scheduler, Statistics &stats) :
+        _io_service(io_service), _timer(io_service), _interval(boost::posix_time::seconds(5)), _round(0),
+        _scheduler(scheduler), _stats(stats)
+    {
+    }
+
+    /// Sets the probe interval in milliseconds.
+    void interval(uint32_t interval)
+    {
+        _interval=boost::posix_time::milliseconds(interval ? interval : 1);
+    }
+
+    /// Sets the handler called after a switch of the replica.
+    void on_switch(Handler on_switch)
+    {
+        _on_switch=on_switch;
+    }
+
+    /**
+     * Adds a replica to a bridge. The server the bridge was created with is its first replica.
+     *
+     * \param resp      The bridge
+     * \param server    The host name or address of the replica
+     * \param service   The port of the replica
+     */
+    void replica(Responder &resp, const std::string &server, const std::string &service)
+    {
+        auto b=std::find_if(_bridges.begin(), _bridges.end(), [&](const Bridge &b) { return b.resp==&resp; });
+        if (b==_bridges.end())
+        {
+            _bridges.push_back(Bridge{&resp, {Replica{resp.server(), resp.service(), -1, 1, true, false}}, 0});
+            b=_bridges.end()-1;
+        }
+        b->replicas.push_back(Replica{server, service, -1, 1, true, false});
+    }
+
+    /// Starts probing.
+    void start()
+    {
+        if (!_bridges.empty()) expired(boost::system::error_code());
+    }
+
+private:
+    /// Probes the active replicas every half interval and the others every interval, if the previous probe finished.
+    void expired(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        for (size_t i=0; i<_bridges.size(); ++i)
+            for (size_t j=0; j<_bridges[i].replicas.size(); ++j)
+                if (!_bridges[i].replicas[j].probing && (_round%2==0 || j==_bridges[i].active)) probe(i, j);
+        ++_round;
+        _timer.expires_from_now(_interval/2);
+        _timer.async_wait(boost::bind(&Prober::expired, this, placeholders::error));
+    }
+
+    /// Starts the probe of replica j of bridge i.
+    void probe(size_t i, size_t j)
+    {
+        Replica &r=_bridges[i].replicas[j];
+        r.probing=true;
+        ++_stats.probes;
+        _scheduler.submit(r.server, r.service, Scheduler::class_background, [this, i, j](Scheduler::Done finished)
+            {
+                // The round trip time is measured from the dispatch on, the time in the queue is not the replica's
+                const Replica &r=_bridges[i].replicas[j];
+                const boost::posix_time::ptime started=boost::posix_time::microsec_clock::universal_time();
+                Download::start(_io_service, r.server, r.service, "/description.xml",
+                    [this, i, j, started, finished](const boost::system::error_code &e, const std::string &)
+                    {
+                        finished();
+                        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+                        probed(i, j, !e, (now-started).total_microseconds()/1000.0);
+                    }, _stats, _interval/2);
+            });
+    }
+
+    /// Updates the health of replica j of bridge i and selects the replica of the bridge.
+    void probed(size_t i, size_t j, bool ok, double rtt)
+    {
+        Bridge &b=_bridges[i];
+        Replica &r=b.replicas[j];
+        r.probing=false;
+        r.up=ok;
+        r.success=r.success*0.8+(ok ? 0.2 : 0.0);
+        if (ok) r.rtt=r.rtt<0 ? rtt : r.rtt*0.7+rtt*0.3;
+        else ++_stats.probe_errors;
+
+        const Replica &active=b.replicas[b.active];
+        size_t best=b.replicas.size();
+        for (size_t k=0; k<b.replicas.size(); ++k)
+        {
+            const Replica &c=b.replicas[k];
+            if (c.up && c.rtt>=0 && (best==b.replicas.size() || score(c)<score(b.replicas[best]))) best=k;
+        }
+        if (best==b.replicas.size() || best==b.active) return;
+        // A healthy active replica is kept until its first probe finished and unless the other is clearly better
+        if (active.up && (active.rtt<0 || score(b.replicas[best])*1.25+1>score(active))) return;
+
+        b.active=best;
+        ++_stats.switches;
+        std::cerr << "Advertising " << b.replicas[best].server << ":" << b.replicas[best].service << " instead of "
+            << active.server << ":" << active.service << "." << std::endl;
+        b.resp->upstream(b.replicas[best].server, b.replicas[best].service);
+        if (_on_switch) _on_switch(*b.resp);
+    }
+
+    /// The cost of a replica, lower is better.
+    static double score(const Replica &r)
+    {
+        return r.rtt/std::max(r.success, 0.01);
+    }
+};
+
+/**
+ * One client connection of an HTTP server in front of an API, which reads a request with its body and
+ * sends one response. It is kept alive by the shared pointers bound to its handlers.
+ *
+ * Owner::request(session, head, body) is called with the complete request and the decoded body, and
+ * answers by respond().
+ */
+template<typename Owner>
+class HttpSession : public std::enable_shared_from_this<HttpSession<Owner>>
+{
+private:
+    Owner &_owner;
+    ip::tcp::socket _socket;
+    streambuf _request;
+    std::string _head;
+    HttpMessage _message;   ///< Views into _head
+    Dechunker _dechunker;
+    std::string _body;
+    std::string _response;
+    Statistics &_stats;
+
+public:
+    HttpSession(Owner &owner, io_service &io_service, Statistics &stats) :
+        _owner(owner), _socket(io_service), _request(65536), _stats(stats)
+    {
+    }
+
+    ip::tcp::socket &socket()
+    {
+        return _socket;
+    }
+
+    void start()
+    {
+        async_read_until(_socket, _request, "\r\n\r\n",
+            boost::bind(&HttpSession::header, this->shared_from_this(), placeholders::error,
+                placeholders::bytes_transferred));
+    }
+
+    /// Sends the response and closes the connection.
+    void respond(const std::string &response)
+    {
+        _response=response;
+        async_write(_socket, buffer(_response),
+            boost::bind(&HttpSession::written, this->shared_from_this(), placeholders::error));
+    }
+
+private:
+    /// Parses the head and reads the body given by Content-Length or the chunked transfer coding.
+    void header(const boost::system::error_code &e, size_t bytes)
+    {
+        ++_stats.wakeups;
+        if (e) return;
+        _head.assign(buffers_begin(_request.data()), buffers_begin(_request.data())+bytes);
+        _request.consume(bytes);
+        if (parse_request(_head.data(), _head.size(), _message)!=http_complete)
+            return respond("HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n");
+        if (_message.chunked) return chunks();
+
+        if (_message.length>_request.max_size())
+            return respond("HTTP/1.0 413 Payload Too Large\r\nConnection: close\r\n\r\n");
+        const size_t length=_message.length;
+        const size_t buffered=std::min(length, _request.size());
+        async_read(_socket, _request, transfer_exactly(length-buffered),
+            [self=this->shared_from_this(), length](const boost::system::error_code &e, size_t)
+            {
+                ++self->_stats.wakeups;
+                if (e) return;
+                self->_body.assign(buffers_begin(self->_request.data()),
+                    buffers_begin(self->_request.data())+length);
+                self->_owner.request(self, self->_message, self->_body);
+            });
+    }
+
+    /// Decodes the received part of a chunked body and reads on until the last chunk.
+    void chunks()
+    {
+        const size_t decoded=_body.size();
+        _body.append(buffers_begin(_request.data()), buffers_end(_request.data()));
+        _request.consume(_request.size());
+        size_t bytes=_body.size()-decoded;
+        const HttpResult result=_dechunker.decode(&_body[decoded], bytes);
+        _body.resize(decoded+bytes);
+        if (result==http_invalid) return respond("HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n");
+        if (result==http_complete) return _owner.request(this->shared_from_this(), _message, _body);
+        if (_body.size()>_request.max_size())
+            return respond("HTTP/1.0 413 Payload Too Large\r\nConnection: close\r\n\r\n");
+        _socket.async_read_some(_request.prepare(4096),
+            [self=this->shared_from_this()](const boost::system::error_code &e, size_t bytes)
+            {
+                ++self->_stats.wakeups;
+                if (e) return;
+                self->_request.commit(bytes);
+                self->chunks();
+            });
+    }
+
+    void written(const boost::system::error_code &)
+    {
+        ++_stats.wakeups;
+        boost::system::error_code ignored;
+        _socket.shutdown(ip::tcp::socket::shutdown_both, ignored);
+    }
+};
+
+/**
+ * HTTP proxy in front of the API of a bridge.
+ *
+ * Controllers send their API calls to the host and port of the LOCATION, so a bridge advertised with the
+ * address of the proxy is controlled through hued. Each request is forwarded as HTTP/1.0 to the server the
+ * bridge is currently advertised with (see Prober), the response is passed back and the connection closed.
+ *
+ * Light state changes (PUT /api/<user>/lights/<id>/state) are answered right away with the success
+ * response of the bridge and written behind: the changes of a light are merged until it may be written
+ * again, where the last value wins per attribute and increments (bri_inc etc.) add up within the range of
+ * the API. Each light gets at most one upstream write per interval and one at a time, so a dimmer dragged
+ * with 50 changes per second costs 10 upstream writes at the default interval of 100 ms. A failed write is
+ * merged back under the newer changes and written again, up to #_max_retries times. A group action (which
+ * includes recalling a scene) waits until the changes of the lights of the user merged before it were
+ * written, and these are written right away, so an older change of a light does not land after it.
+ *
+ * With a batch window, identical state changes of several lights of one user within the window (like
+ * "turn off the kitchen" expanded into one PUT per light) are sent as one group action instead: to the
+ * group of the bridge with exactly these lights, or to a temporary group created for them and deleted
+ * afterwards if that costs fewer requests than writing each light. The groups are read from the bridge
+ * before they are used if the last read is older than #_groups_max_age. A light which changes again
+ * within the window closes it early, and its later changes are not written before the group action
+ * finished, so the changes of a light keep their order. If the group action fails, the lights are
+ * written one by one.
+ */
+class Proxy
+{
+private:
+    typedef HttpSession<Proxy> Session;
+    friend Session;
+
+    /// The write-behind state of a light
+    struct Light
+    {
+        std::string path;       ///< The path of the state resource
+        std::string headers;    ///< The forwarded headers of the last change
+        std::vector<std::pair<std::string, std::string>> pending;   ///< Merged attributes and their JSON values
+        std::vector<std::pair<std::string, std::string>> inflight;  ///< The attributes of the running write
+        bool writing=false;
+        bool urgent=false;      ///< Write without waiting for the interval, see after_writes()
+        unsigned actions=0;     ///< Group actions of batches with this light which did not finish
+        unsigned failures=0;    ///< Failed writes in a row
+        uint64_t merged=0;      ///< State changes merged so far
+        uint64_t sent=0;        ///< State changes covered by the running or the last write
+        uint64_t done=0;        ///< State changes written or given up
+        boost::posix_time::ptime written;
+        std::unique_ptr<deadline_timer> timer;
+    };
+
+    /// A request held back until the changes of lights merged before it were written
+    struct Barrier
+    {
+        std::vector<std::pair<Light*, uint64_t>> lights;    ///< The lights and their Light::merged at the time
+        std::function<void()> job;
+    };
+
+    /// Identical state changes of several lights within the batch window
+    struct Batch
+    {
+        std::string user;
+        std::string headers;
+        std::vector<std::pair<std::string, std::string>> state;
+        std::vector<std::string> lights;    ///< The IDs of the lights
+        /// Per light the pending changes of the attributes of state merged before, sent as group action
+        std::vector<std::vector<std::pair<std::string, std::string>>> older;
+    };
+    typedef std::vector<std::pair<std::string, std::vector<std::string>>> Groups;  ///< IDs and sorted lights
+
+    io_service &_io_service;
+    Responder &_resp;
+    ip::tcp::acceptor _acceptor;
+    boost::posix_time::time_duration _interval;
+    std::map<std::string, Light> _lights;   ///< By path
+    std::vector<Barrier> _barriers;
+    static const unsigned _max_retries=3;
+    boost::posix_time::time_duration _window;
+    deadline_timer _window_timer;
+    std::map<std::string, Batch> _batches;  ///< By user and state
+    std::map<std::string, std::pair<boost::posix_time::ptime, Groups>> _groups;   ///< By user, with time of reading
+    static constexpr long _groups_max_age=60;   ///< Seconds
+    Scheduler &_scheduler;
+    Statistics &_stats;
+
+public:
+    /**
+     * The constructor opens the TCP port and starts accepting.
+     *
+     * \param resp      The bridge, whose current server receives the requests
+     */
+    Proxy(io_service &io_service, Responder &resp, uint16_t port, Scheduler &scheduler, Statistics &stats) :
+        _io_service(io_service), _resp(resp), _acceptor(io_service, ip::tcp::endpoint(ip::tcp::v4(), port)),
+        _interval(boost::posix_time::milliseconds(100)), _window_timer(io_service), _scheduler(scheduler),
+        _stats(stats)
+    {
+        accept();
+    }
+
+    /// Sets the shortest time between two upstream writes of the state of a light in milliseconds.
+    void interval(uint32_t interval)
+    {
+        _interval=boost::posix_time::milliseconds(interval);
+    }
+
+    /// Sets the window in milliseconds for batching state changes into group actions, 0 disables batching.
+    void window(uint32_t window)
+    {
+        _window=boost::posix_time::milliseconds(window);
+    }
+
+    /**
+     * Splits a JSON object into its members, the values are kept as JSON text.
+     *
+     * \return          False if json is no object or malformed
+     */
+    static bool members(std::string_view json, std::vector<std::pair<std::string, std::string>> &out)
+    {
+        size_t i=0;
+        auto skip=[&]() { while (i<json.size() && isspace(static_cast<unsigned char>(json[i]))) ++i; };
+        // Returns the end of the string starting at i
+        auto string_end=[&](size_t i) -> size_t
+            {
+                for (++i; i<json.size(); ++i)
+                {
+                    if (json[i]=='\\') ++i;
+                    else if (json[i]=='"') return i+1;
+                }
+                return std::string_view::npos;
+            };
+        skip();
+        if (i==json.size() || json[i++]!='{') return false;
+        skip();
+        if (i<json.size() && json[i]=='}') return true;
+        while (i<json.size())
+        {
+            if (json[i]!='"') return false;
+            const size_t key_end=string_end(i);
+            if (key_end==std::string_view::npos) return false;
+            const std::string key(json.substr(i+1, key_end-i-2));
+            i=key_end;
+            skip();
+            if (i==json.size() || json[i++]!=':') return false;
+            skip();
+            const size_t value=i;
+            int depth=0;
+            while (i<json.size() && (depth || (json[i]!=',' && json[i]!='}')))
+            {
+                if (json[i]=='"')
+                {
+                    i=string_end(i);
+                    if (i==std::string_view::npos) return false;
+                    continue;
+                }
+                if (json[i]=='[' || json[i]=='{') ++depth;
+                else if (json[i]==']' || json[i]=='}') --depth;
+                ++i;
+            }
+            if (i==json.size() || i==value) return false;
+            size_t end=i;
+            while (end>value && isspace(static_cast<unsigned char>(json[end-1]))) --end;
+            out.emplace_back(key, std::string(json.substr(value, end-value)));
+            if (json[i++]=='}') return true;
+            skip();
+        }
+        return false;
+    }
+
+    /// Renders a JSON object of members.
+    static std::string object(const std::vector<std::pair<std::string, std::string>> &members)
+    {
+        std::string body="{";
+        for (const auto &m: members) body+=(body.size()>1 ? ",\"" : "\"")+m.first+"\":"+m.second;
+        return body+"}";
+    }
+
+private:
+    void accept()
+    {
+        std::shared_ptr<Session> session=std::make_shared<Session>(*this, _io_service, _stats);
+        _acceptor.async_accept(session->socket(),
+            boost::bind(&Proxy::accepted, this, session, placeholders::error));
+    }
+
+    void accepted(std::shared_ptr<Session> session, const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (!e) session->start();
+        accept();
+    }
+
+    /// Handles a complete request, the body is decoded already.
+    void request(const std::shared_ptr<Session> &session, const HttpMessage &head, const std::string &body)
+    {
+        ++_stats.proxy_requests;
+        const std::string method(head.method);
+        const std::string path(head.target);
+
+        // Keep the end to end headers, the connection is HTTP/1.0 with its own length
+        std::string headers;
+        for (size_t i=0; i<head.count; ++i)
+        {
+            const std::string_view name=head.headers[i].name;
+            if (boost::iequals(name, "host") || boost::iequals(name, "connection") ||
+                boost::iequals(name, "keep-alive") || boost::iequals(name, "content-length") ||
+                boost::iequals(name, "transfer-encoding") || boost::iequals(name, "proxy-connection"))
+                continue;
+            headers.append(name).append(": ").append(head.headers[i].value).append("\r\n");
+        }
+
+        std::vector<std::pair<std::string, std::string>> state;
+        if (method=="PUT" && light_state(path) && members(body, state) && !state.empty())
+        {
+            session->respond(success(path, state));
+            if (_window.total_milliseconds()) return batch(path, headers, state);
+            return write(path, headers, state);
+        }
+        if (method=="PUT" && group_action(path))
+        {
+            return after_writes(path.substr(5, path.find('/', 5)-5),
+                [this, session, method, path, headers, body]() { forward(session, method, path, headers, body); });
+        }
+        forward(session, method, path, headers, body);
+    }
+
+    /// Forwards a request and passes the response back.
+    void forward(const std::shared_ptr<Session> &session, const std::string &method, const std::string &path,
+        const std::string &headers, const std::string &body)
+    {
+        send(method, path, headers, body,
+            [this, session](const boost::system::error_code &e, const std::string &response)
+            {
+                if (e || response.empty())
+                {
+                    ++_stats.proxy_errors;
+                    return session->respond("HTTP/1.0 502 Bad Gateway\r\nConnection: close\r\n\r\n");
+                }
+                session->respond(response);
+            }, method=="GET" ? Scheduler::class_client : Scheduler::class_interactive);
+    }
+
+    /**
+     * Sends a request to the current server of the bridge, the handler gets the raw response.
+     *
+     * \param cls       The priority of the request, the writes of the proxy and their group lookups are interactive
+     */
+    void send(const std::string &method, const std::string &path, const std::string &headers,
+        const std::string &body, Download::Handler handler, Scheduler::Class cls=Scheduler::class_interactive)
+    {
+        const std::string request=method+" "+path+" HTTP/1.0\r\nHost: "+_resp.server()+"\r\n"+headers+
+            (body.empty() && method=="GET" ? "" : "Content-Length: "+std::to_string(body.size())+"\r\n")+
+            "Connection: close\r\n\r\n"+body;
+        const std::string server=_resp.server();
+        const std::string service=_resp.service();
+        _scheduler.submit(server, service, cls, [this, server, service, request, handler](Scheduler::Done finished)
+            {
+                Download::exchange(_io_service, server, service, request,
+                    [handler, finished](const boost::system::error_code &e, const std::string &response)
+                    {
+                        finished();
+                        handler(e, response);
+                    }, _stats);
+            });
+    }
+
+    /**
+     * Checks if a raw response has the status 200.
+     *
+     * \param body      Receives the decoded body if not null
+     */
+    static bool ok(const boost::system::error_code &e, const std::string &response, std::string *body=nullptr)
+    {
+        HttpMessage m;
+        if (e || parse_response(response.data(), response.size(), m)!=http_complete || m.status!=200) return false;
+        if (!body) return true;
+        body->assign(response, m.head, std::string::npos);
+        size_t bytes=body->size();
+        if (m.chunked && Dechunker().decode(&(*body)[0], bytes)!=http_complete) return false;
+        body->resize(bytes);
+        return true;
+    }
+
+    /// Checks if path has the form /api/<user>/lights/<id>/state.
+    static bool light_state(const std::string &path)
+    {
+        std::vector<std::string> parts;
+        std::istringstream segments(path);
+        for (std::string s; std::getline(segments, s, '/'); ) parts.push_back(s);
+        return parts.size()==6 && parts[0].empty() && parts[1]=="api" && !parts[2].empty() &&
+            parts[3]=="lights" && !parts[4].empty() && parts[5]=="state";
+    }
+
+    /// Checks if path has the form /api/<user>/groups/<id>/action.
+    static bool group_action(const std::string &path)
+    {
+        std::vector<std::string> parts;
+        std::istringstream segments(path);
+        for (std::string s; std::getline(segments, s, '/'); ) parts.push_back(s);
+        return parts.size()==6 && parts[0].empty() && parts[1]=="api" && !parts[2].empty() &&
+            parts[3]=="groups" && !parts[4].empty() && parts[5]=="action";
+    }
+
+    /// Renders the response of the bridge to a successful state change.
+    static std::string success(const std::string &path, const std::vector<std::pair<std::string, std::string>> &state)
+    {
+        // The resource path in the response starts after /api/<user>
+        const std::string resource=path.substr(path.find('/', 5));
+        std::string body="[";
+        for (const auto &s: state)
+            body+=(body.size()>1 ? ",{\"success\":{\"" : "{\"success\":{\"")+resource+"/"+s.first+"\":"+s.second+"}}";
+        body+="]";
+        return "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: "+std::to_string(body.size())+
+            "\r\nConnection: close\r\n\r\n"+body;
+    }
+
+    /// Merges a state change into the pending changes of the light and writes them when allowed.
+    void write(const std::string &path, const std::string &headers,
+        const std::vector<std::pair<std::string, std::string>> &state)
+    {
+        Light &light=_lights[path];
+        light.path=path;
+        light.headers=headers;
+        if (!light.pending.empty()) ++_stats.proxy_coalesced;
+        for (const auto &s: state) merge(light.pending, s);
+        ++light.merged;
+        flush(light);
+    }
+
+    /**
+     * Merges an attribute into pending changes. Increments add up and are clamped to the range the API
+     * accepts, bri_inc and sat_inc -254 to 254, hue_inc and ct_inc -65534 to 65534.
+     *
+     * \param older     The attribute is older than the pending ones, so it does not replace a pending value
+     */
+    static void merge(std::vector<std::pair<std::string, std::string>> &pending,
+        const std::pair<std::string, std::string> &change, bool older=false)
+    {
+        auto p=std::find_if(pending.begin(), pending.end(),
+            [&](const std::pair<std::string, std::string> &p) { return p.first==change.first; });
+        if (p==pending.end())
+            pending.insert(older ? pending.begin() : pending.end(), change);
+        else if (boost::ends_with(change.first, "_inc") &&
+            change.second.find_first_not_of("-0123456789")==std::string::npos &&
+            p->second.find_first_not_of("-0123456789")==std::string::npos)
+        {
+            const long limit=change.first=="bri_inc" || change.first=="sat_inc" ? 254 : 65534;
+            const long sum=strtol(p->second.c_str(), nullptr, 10)+strtol(change.second.c_str(), nullptr, 10);
+            p->second=std::to_string(std::max(-limit, std::min(limit, sum)));
+        }
+        else if (!older)
+            p->second=change.second;
+    }
+
+    /// Writes the pending changes of a light if it is not written and its interval passed, or waits.
+    void flush(Light &light)
+    {
+        if (light.writing || light.actions || light.pending.empty()) return;
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        if (!light.urgent && !light.written.is_not_a_date_time() && now<light.written+_interval)
+        {
+            if (!light.timer) light.timer.reset(new deadline_timer(_io_service));
+            light.timer->expires_at(light.written+_interval);
+            light.timer->async_wait([this, &light](const boost::system::error_code &e)
+                {
+                    if (e) return;
+                    ++_stats.wakeups;
+                    flush(light);
+                });
+            return;
+        }
+
+        light.inflight.swap(light.pending);
+        light.pending.clear();
+        light.writing=true;
+        light.urgent=false;
+        light.written=now;
+        light.sent=light.merged;
+        ++_stats.proxy_writes;
+        send("PUT", light.path, light.headers, object(light.inflight),
+            [this, &light](const boost::system::error_code &e, const std::string &response)
+            {
+                const bool failed=!ok(e, response);
+                if (failed) ++_stats.proxy_errors;
+                if (failed && ++light.failures<=_max_retries)
+                {
+                    // The client was told that the change succeeded, so it is written again with the newer ones
+                    for (const auto &s: light.inflight) merge(light.pending, s, true);
+                    std::cerr << "Writing " << light.path << " to " << _resp.server() << " failed, retrying."
+                        << std::endl;
+                }
+                else
+                {
+                    if (light.failures>_max_retries)
+                        std::cerr << "Writing " << light.path << " to " << _resp.server() << " failed, giving up."
+                            << std::endl;
+                    light.failures=0;
+                    light.done=light.sent;
+                }
+                light.inflight.clear();
+                light.writing=false;
+                flush(light);
+                release();
+            });
+    }
+
+    /**
+     * Runs job after the changes of the lights of user merged so far were written, which are written right
+     * away without waiting for their interval.
+     */
+    void after_writes(const std::string &user, std::function<void()> job)
+    {
+        Barrier barrier{{}, job};
+        const std::string prefix="/api/"+user+"/lights/";
+        for (auto l=_lights.lower_bound(prefix); l!=_lights.end() && boost::starts_with(l->first, prefix); ++l)
+        {
+            Light &light=l->second;
+            if (light.done>=light.merged) continue;
+            barrier.lights.emplace_back(&light, light.merged);
+            light.urgent=true;
+            flush(light);
+        }
+        if (barrier.lights.empty()) return job();
+        _barriers.push_back(barrier);
+    }
+
+    /// Runs the jobs of the barriers whose lights were written.
+    void release()
+    {
+        std::vector<std::function<void()>> jobs;
+        for (auto b=_barriers.begin(); b!=_barriers.end(); )
+        {
+            if (std::all_of(b->lights.begin(), b->lights.end(),
+                [](const std::pair<Light*, uint64_t> &l) { return l.first->done>=l.second; }))
+            {
+                jobs.push_back(b->job);
+                b=_barriers.erase(b);
+            }
+            else
+                ++b;
+        }
+        for (const auto &job: jobs) job();
+    }
+
+    /// Collects a state change of a light in the batch window.
+    void batch(const std::string &path, const std::string &headers,
+        const std::vector<std::pair<std::string, std::string>> &state)
+    {
+        // path is /api/<user>/lights/<id>/state
+        const size_t user=5, lights=path.find('/', user), id=lights+8;
+        std::vector<std::pair<std::string, std::string>> sorted(state);
+        std::sort(sorted.begin(), sorted.end());
+        const std::string key=path.substr(user, lights-user)+"\n"+object(sorted);
+        const std::string light=path.substr(id, path.find('/', id)-id);
+        const bool increments=std::any_of(state.begin(), state.end(),
+            [](const std::pair<std::string, std::string> &s) { return boost::ends_with(s.first, "_inc"); });
+        for (const auto &o: _batches)
+        {
+            const Batch &other=o.second;
+            if (other.user!=path.substr(user, lights-user) ||
+                std::find(other.lights.begin(), other.lights.end(), light)==other.lights.end())
+                continue;
+            // The same change again is already in the batch, unless it adds up
+            if (o.first==key && !increments) return;
+            // Otherwise the window is sent first, the batches of a window are sent in no particular order
+            _window_timer.cancel();
+            batched(boost::system::error_code());
+            break;
+        }
+
+        Batch &b=_batches[key];
+        b.user=path.substr(user, lights-user);
+        b.headers=headers;
+        b.state=state;
+        b.lights.push_back(light);
+
+        if (_batches.size()==1 && b.lights.size()==1)
+        {
+            _window_timer.expires_from_now(_window);
+            _window_timer.async_wait(boost::bind(&Proxy::batched, this, placeholders::error));
+        }
+    }
+
+    /// Sends the batches of the closed window.
+    void batched(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        std::map<std::string, Batch> batches;
+        batches.swap(_batches);
+        const boost::posix_time::ptime now=boost::posix_time::second_clock::universal_time();
+        for (auto &b: batches)
+        {
+            Batch &batch=b.second;
+            std::sort(batch.lights.begin(), batch.lights.end());
+            const boost::posix_time::ptime read=_groups[batch.user].first;
+            if (batch.lights.size()<2)
+            {
+                lights(batch);
+                continue;
+            }
+            // Older changes of the same attributes must not overwrite the action later, they are kept aside
+            // until it succeeded. Later changes of the lights wait until then, see settle().
+            batch.older.resize(batch.lights.size());
+            for (size_t i=0; i<batch.lights.size(); ++i)
+            {
+                Light &light=_lights["/api/"+batch.user+"/lights/"+batch.lights[i]+"/state"];
+                light.path="/api/"+batch.user+"/lights/"+batch.lights[i]+"/state";
+                ++light.actions;
+                const auto overwritten=std::stable_partition(light.pending.begin(), light.pending.end(),
+                    [&](const std::pair<std::string, std::string> &p)
+                    {
+                        return std::none_of(batch.state.begin(), batch.state.end(),
+                            [&](const std::pair<std::string, std::string> &s) { return s.first==p.first; });
+                    });
+                batch.older[i].assign(overwritten, light.pending.end());
+                light.pending.erase(overwritten, light.pending.end());
+            }
+            if (!read.is_not_a_date_time() && now-read<=boost::posix_time::seconds(_groups_max_age))
+                group(batch);
+            else
+            {
+                // Read the groups first
+                send("GET", "/api/"+batch.user+"/groups", batch.headers, "",
+                    [this, batch](const boost::system::error_code &e, const std::string &response)
+                    {
+                        std::string body;
+                        if (ok(e, response, &body)) groups(batch.user, body);
+                        group(batch);
+                    });
+            }
+        }
+    }
+
+    /// Stores the groups of a user from the JSON object of /api/<user>/groups.
+    void groups(const std::string &user, const std::string &json)
+    {
+        std::vector<std::pair<std::string, std::string>> ids, members;
+        if (!Proxy::members(json, ids)) return;
+        Groups groups;
+        for (const auto &g: ids)
+        {
+            members.clear();
+            if (!Proxy::members(g.second, members)) continue;
+            const auto l=std::find_if(members.begin(), members.end(),
+                [](const std::pair<std::string, std::string> &m) { return m.first=="lights"; });
+            if (l==members.end()) continue;
+            std::vector<std::string> lights;
+            for (size_t q=l->second.find('"'); q!=std::string::npos; q=l->second.find('"', q+1))
+            {
+                const size_t end=l->second.find('"', q+1);
+                if (end==std::string::npos) break;
+                lights.push_back(l->second.substr(q+1, end-q-1));
+                q=end;
+            }
+            std::sort(lights.begin(), lights.end());
+            groups.emplace_back(g.first, lights);
+        }
+        _groups[user]=std::make_pair(boost::posix_time::second_clock::universal_time(), groups);
+    }
+
+    /// Sends a batch as action of the matching group, of a temporary group or to each light.
+    void group(const Batch &batch)
+    {
+        const Groups &groups=_groups[batch.user].second;
+        const auto g=std::find_if(groups.begin(), groups.end(),
+            [&](const std::pair<std::string, std::vector<std::string>> &g) { return g.second==batch.lights; });
+        if (g!=groups.end()) return action(batch, g->first, false);
+        // Creating, using and deleting a temporary group costs three requests
+        if (batch.lights.size()<=3) return settle(batch, true);
+
+        std::string lights="[";
+        for (const std::string &l: batch.lights) lights+=(lights.size()>1 ? ",\"" : "\"")+l+"\"";
+        lights+="]";
+        send("POST", "/api/"+batch.user+"/groups", batch.headers,
+            "{\"lights\":"+lights+",\"type\":\"LightGroup\",\"name\":\"hued batch\"}",
+            [this, batch](const boost::system::error_code &e, const std::string &response)
+            {
+                // The response is [{"success":{"id":"<id>"}}]
+                const size_t id=response.find("\"id\"");
+                const size_t start=id==std::string::npos ? id : response.find('"', response.find(':', id)+1);
+                const size_t end=start==std::string::npos ? start : response.find('"', start+1);
+                if (!ok(e, response) || end==std::string::npos) return settle(batch, true);
+                action(batch, response.substr(start+1, end-start-1), true);
+            });
+    }
+
+    /// Sends a batch as action of a group and deletes the group afterwards if it is temporary.
+    void action(const Batch &batch, const std::string &group, bool temporary)
+    {
+        ++_stats.proxy_group_actions;
+        _stats.proxy_batched+=batch.lights.size();
+        const std::string path="/api/"+batch.user+"/groups/"+group;
+        send("PUT", path+"/action", batch.headers, object(batch.state),
+            [this, batch, path, temporary](const boost::system::error_code &e, const std::string &response)
+            {
+                const bool failed=!ok(e, response);
+                if (failed)
+                {
+                    ++_stats.proxy_errors;
+                    std::cerr << "Writing " << path << "/action to " << _resp.server() << " failed, writing the "
+                        "lights." << std::endl;
+                }
+                settle(batch, failed);
+                if (temporary)
+                    send("DELETE", path, batch.headers, "", [](const boost::system::error_code &, const std::string &) {});
+            });
+    }
+
+    /// Writes the state of each light of a batch.
+    void lights(const Batch &batch)
+    {
+        for (const std::string &l: batch.lights)
+            write("/api/"+batch.user+"/lights/"+l+"/state", batch.headers, batch.state);
+    }
+
+    /**
+     * Lets the lights of a batch sent as group action be written again.
+     *
+     * \param write     The group action was not sent or failed, so the lights are written one by one, the
+     *                  state of the batch merged between the older changes and the ones received since
+     */
+    void settle(const Batch &batch, bool write)
+    {
+        for (size_t i=0; i<batch.lights.size(); ++i)
+        {
+            Light &light=_lights["/api/"+batch.user+"/lights/"+batch.lights[i]+"/state"];
+            --light.actions;
+            if (write)
+            {
+                std::vector<std::pair<std::string, std::string>> pending(batch.older[i]);
+                for (const auto &s: batch.state) merge(pending, s);
+                for (const auto &s: light.pending) merge(pending, s);
+                light.pending.swap(pending);
+                light.headers=batch.headers;
+                ++light.merged;
+            }
+            flush(light);
+        }
+        release();
+    }
+};
+
+/**
+ * Passes the state changes of emulated lights to the software which switches the real lights.
+ *
+ * - "exec:COMMAND" runs COMMAND by /bin/sh for each change, with the light ID as $1 and the changed
+ *   attributes as JSON object in $2. Each change gets its own process, at most #max_children run at once
+ *   and further changes wait in order. The commands inherit only stdin, stdout and stderr, not the sockets.
+ * - "unix:PATH" sends the datagram {"light":"<id>","state":{...}} to the UNIX socket PATH.
+ * - "mqtt:HOST:PORT[/PREFIX]" publishes the changed attributes with QoS 0 to PREFIX/lights/<id>/set
+ *   (PREFIX defaults to "hued") on an MQTT 3.1.1 broker, usually on the same host. Changes made while the
+ *   broker is not connected are queued up to a limit, the connection is retried every t_refresh_min
+ *   seconds.
+ *
+ * Failed deliveries are counted as backend_errors.
+ */
+class Backend
+{
+private:
+    enum Kind
+    {
+        kind_exec,
+        kind_unix,
+        kind_mqtt
+    };
+    enum State
+    {
+        state_waiting,      ///< Waiting to connect to the broker
+        state_connecting,
+        state_connected
+    };
+    static const size_t max_queued=256;     ///< MQTT messages kept while the broker is down, commands waiting
+    static const uint8_t keep_alive=60;     ///< MQTT keep alive in seconds, a ping is sent every half of it
+    static const unsigned max_children=4;   ///< Commands running at once
+
+    io_service &_io_service;
+    Kind _kind;
+    std::string _target;    ///< The command, the socket path or the host of the broker
+    std::string _port;      ///< The port of the broker
+    std::string _prefix;    ///< The topic prefix
+    signal_set _children;
+    unsigned _running;      ///< Commands running
+    std::deque<std::pair<std::string, std::string>> _commands;  ///< Changes waiting for a command, light and state
+    local::datagram_protocol::socket _datagram;
+    ip::tcp::resolver _resolver;
+    ip::tcp::socket _broker;
+    deadline_timer _timer;
+    deadline_timer _ping;
+    State _state;
+    bool _writing;
+    std::string _connect;               ///< The CONNECT packet being sent
+    std::deque<std::string> _queue;     ///< MQTT packets to send
+    std::array<char, 256> _received;
+    Statistics &_stats;
+
+public:
+    /**
+     * \param spec      "exec:COMMAND", "unix:PATH" or "mqtt:HOST:PORT[/PREFIX]"
+     * \throws std::invalid_argument if spec has none of these forms
+     */
+    Backend(io_service &io_service, const std::string &spec, Statistics &stats) :
+        _io_service(io_service), _kind(kind_exec), _prefix("hued"), _children(io_service), _running(0),
+        _datagram(io_service), _resolver(io_service), _broker(io_service), _timer(io_service), _ping(io_service),
+        _state(state_waiting), _writing(false), _stats(stats)
+    {
+        const size_t colon=spec.find(':');
+        const std::string kind=spec.substr(0, colon);
+        _target=colon==std::string::npos ? std::string() : spec.substr(colon+1);
+        if (_target.empty()) throw std::invalid_argument("Missing target in backend '"+spec+"'");
+        if (kind=="exec")
+        {
+            _kind=kind_exec;
+            _children.add(SIGCHLD);
+            _children.async_wait(boost::bind(&Backend::reap, this, placeholders::error, placeholders::signal_number));
+        }
+        else if (kind=="unix")
+        {
+            _kind=kind_unix;
+            _datagram.open();
+            _datagram.non_blocking(true);
+        }
+        else if (kind=="mqtt")
+        {
+            _kind=kind_mqtt;
+            const size_t slash=_target.find('/');
+            if (slash!=std::string::npos)
+            {
+                _prefix=_target.substr(slash+1);
+                _target.erase(slash);
+            }
+            const size_t port=_target.rfind(':');
+            if (port==std::string::npos) throw std::invalid_argument("Missing port in backend '"+spec+"'");
+            _port=_target.substr(port+1);
+            _target.erase(port);
+            connect();
+        }
+        else throw std::invalid_argument("Unknown backend '"+spec+"'");
+    }
+
+    /**
+     * Passes a state change.
+     *
+     * \param light     The ID of the light
+     * \param state     The changed attributes as JSON object
+     */
+    void change(const std::string &light, const std::string &state)
+    {
+        switch (_kind)
+        {
+        case kind_exec:
+            if (_running<max_children)
+                spawn(light, state);
+            else
+            {
+                if (_commands.size()>=max_queued)
+                {
+                    _commands.pop_front();
+                    ++_stats.backend_errors;
+                }
+                _commands.emplace_back(light, state);
+            }
+            break;
+        case kind_unix:
+            {
+                const std::string message="{\"light\":\""+light+"\",\"state\":"+state+"}\n";
+                boost::system::error_code e;
+                _datagram.send_to(buffer(message), local::datagram_protocol::endpoint(_target), 0, e);
+                if (e) ++_stats.backend_errors;
+            }
+            break;
+        case kind_mqtt:
+            {
+                std::string body;
+                field(body, _prefix+"/lights/"+light+"/set");
+                body+=state;
+                if (_queue.size()>=max_queued)
+                {
+                    // The front is the buffer of a running write, which must stay until it completed
+                    _queue.erase(_writing ? _queue.begin()+1 : _queue.begin());
+                    ++_stats.backend_errors;
+                }
+                _queue.push_back(packet('\x30', body));
+                send();
+            }
+            break;
+        }
+    }
+
+private:
+    /// Runs the command for a change, without the descriptors of hued besides stdin, stdout and stderr.
+    void spawn(const std::string &light, const std::string &state)
+    {
+        const char *argv[]={"sh", "-c", _target.c_str(), "hued", light.c_str(), state.c_str(), nullptr};
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 34)
+        posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#else
+        if (DIR *fds=opendir("/proc/self/fd"))
+        {
+            while (const dirent *fd=readdir(fds))
+            {
+                const int n=atoi(fd->d_name);
+                if (n>2 && n!=dirfd(fds)) posix_spawn_file_actions_addclose(&actions, n);
+            }
+            closedir(fds);
+        }
+#endif
+        pid_t pid;
+        if (posix_spawn(&pid, "/bin/sh", &actions, nullptr, const_cast<char**>(argv), environ))
+            ++_stats.backend_errors;
+        else
+            ++_running;
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    /// Collects the exit status of the finished commands and starts the waiting ones.
+    void reap(const boost::system::error_code &e, int)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        int status;
+        while (waitpid(-1, &status, WNOHANG)>0)
+        {
+            if (_running) --_running;
+            if (!WIFEXITED(status) || WEXITSTATUS(status)) ++_stats.backend_errors;
+        }
+        while (_running<max_children && !_commands.empty())
+        {
+            spawn(_commands.front().first, _commands.front().second);
+            _commands.pop_front();
+        }
+        _children.async_wait(boost::bind(&Backend::reap, this, placeholders::error, placeholders::signal_number));
+    }
+
+    /// Appends a string with its 16 bit length.
+    static void field(std::string &out, const std::string &s)
+    {
+        out+=static_cast<char>(s.size()>>8);
+        out+=static_cast<char>(s.size()&0xff);
+        out+=s;
+    }
+
+    /// Builds an MQTT packet from its first byte and the rest, preceded by its variable length.
+    static std::string packet(char type, const std::string &body)
+    {
+        std::string p(1, type);
+        size_t n=body.size();
+        do
+        {
+            p+=static_cast<char>((n%128)|(n>127 ? 0x80 : 0));
+            n/=128;
+        }
+        while (n);
+        return p+body;
+    }
+
+    void connect()
+    {
+        _state=state_connecting;
+        _resolver.async_resolve(_target, _port,
+            boost::bind(&Backend::resolved, this, placeholders::error, placeholders::results));
+    }
+
+    void resolved(const boost::system::error_code &e, const ip::tcp::resolver::results_type &endpoints)
+    {
+        ++_stats.wakeups;
+        if (e) return retry();
+        async_connect(_broker, endpoints, boost::bind(&Backend::connected, this, placeholders::error));
+    }
+
+    /// Sends CONNECT with a clean session.
+    void connected(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return retry();
+        std::string body;
+        field(body, "MQTT");
+        body+='\x04';
+        body+='\x02';
+        body+='\x00';
+        body+=static_cast<char>(keep_alive);
+        field(body, "hued-"+std::to_string(getpid()));
+        _connect=packet('\x10', body);
+        async_write(_broker, buffer(_connect), boost::bind(&Backend::greeted, this, placeholders::error));
+    }
+
+    void greeted(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e) return retry();
+        async_read(_broker, buffer(_received, 4), boost::bind(&Backend::acknowledged, this, placeholders::error));
+    }
+
+    /// Checks the CONNACK and starts sending the queue.
+    void acknowledged(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (e || _received[0]!=0x20 || _received[3]!=0) return retry();
+        _state=state_connected;
+        _writing=false;
+        receive();
+        ping(boost::system::error_code());
+        send();
+    }
+
+    /// Reads and drops the PINGRESPs, a read error means the connection is lost.
+    void receive()
+    {
+        _broker.async_read_some(buffer(_received), [this](const boost::system::error_code &e, size_t)
+            {
+                ++_stats.wakeups;
+                if (e) return retry();
+                receive();
+            });
+    }
+
+    void ping(const boost::system::error_code &e)
+    {
+        if (e || _state!=state_connected) return;
+        _queue.push_back(std::string("\xc0\x00", 2));
+        send();
+        _ping.expires_from_now(boost::posix_time::seconds(keep_alive/2));
+        _ping.async_wait(boost::bind(&Backend::ping, this, placeholders::error));
+    }
+
+    void send()
+    {
+        if (_state!=state_connected || _writing || _queue.empty()) return;
+        _writing=true;
+        async_write(_broker, buffer(_queue.front()), boost::bind(&Backend::sent, this, placeholders::error));
+    }
+
+    void sent(const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        _writing=false;
+        // The packet stays queued and is sent again after reconnecting
+        if (e) return retry();
+        _queue.pop_front();
+        send();
+    }
+
+    /// Closes the connection and connects again after a while.
+    void retry()
+    {
+        if (_state==state_waiting) return;
+        _state=state_waiting;
+        _writing=false;
+        boost::system::error_code ignored;
+        _broker.close(ignored);
+        _ping.cancel();
+        _timer.expires_from_now(boost::posix_time::seconds(t_refresh_min));
+        _timer.async_wait([this](const boost::system::error_code &e)
+            {
+                if (e) return;
+                ++_stats.wakeups;
+                connect();
+            });
+    }
+};
+
+/**
+ * A minimal bridge with the Hue API v1 in memory, for setups without HA-Bridge or another emulator.
+ *
+ * It serves its description.xml, the lights, the groups (group 0 are all lights) and the config, and takes
+ * state changes of lights and actions of groups. Every client gets a username, the link button is always
+ * pressed. The state is copy-on-write: a change copies the current snapshot, applies itself to the copy
+ * and replaces the current snapshot with it, so a request keeps the snapshot it started with and never
+ * sees half of a change. Only the thread running the event loop reads and replaces the state, so the
+ * pointer is a plain shared_ptr. Each applied change of a light is passed to the Backend, with increments
+ * like bri_inc resolved to the resulting value.
+ */
+class Emulator
+{
+public:
+    enum Type
+    {
+        type_dimmable,
+        type_ct,        ///< Color temperature
+        type_color      ///< Extended color
+    };
+
+    /// The state of an emulated light
+    struct Light
+    {
+        std::string name;
+        Type type=type_color;
+        bool on=false;
+        int bri=254;
+        int hue=8418;
+        int sat=140;
+        int ct=366;
+        double x=0.4573;
+        double y=0.41;
+        std::string colormode="ct";
+    };
+    struct Group
+    {
+        std::string name;
+        std::vector<size_t> lights;     ///< Indexes of the lights
+    };
+    /// The state of all lights and groups, never changed after it was published
+    struct Snapshot
+    {
+        std::vector<Light> lights;
+        std::vector<Group> groups;      ///< Groups 1 to n
+    };
+
+private:
+    typedef HttpSession<Emulator> Session;
+    friend Session;
+
+    io_service &_io_service;
+    ip::tcp::acceptor _acceptor;
+    std::string _host;
+    std::string _name;
+    std::string _mac;
+    std::string _uuid;
+    std::string _bridgeid;
+    std::string _description;
+    std::shared_ptr<const Snapshot> _snapshot;  ///< The current state
+    Backend *_backend;
+    std::mt19937_64 _random;
+    Statistics &_stats;
+
+public:
+    /**
+     * The constructor opens the TCP port and starts accepting.
+     *
+     * \param host      The host in the LOCATION of the bridge
+     * \param serial    The serial number, the MAC address of real bridges
+     */
+    Emulator(io_service &io_service, const std::string &host, uint16_t port, const std::string &name,
+        const std::string &serial, const std::string &uuid, const std::string &bridgeid, Statistics &stats) :
+        _io_service(io_service), _acceptor(io_service, ip::tcp::endpoint(ip::tcp::v4(), port)), _host(host),
+        _name(name), _uuid(uuid), _bridgeid(bridgeid),
+        _description((boost::format(HUE_DESCRIPTION)%host%port%name%serial%uuid).str()),
+        _snapshot(std::make_shared<Snapshot>()), _backend(nullptr), _random(std::random_device()()), _stats(stats)
+    {
+        for (size_t i=0; i<serial.size(); i+=2) _mac+=(_mac.empty() ? "" : ":")+serial.substr(i, 2);
+        accept();
+    }
+
+    /// Adds a light with the next ID, starting at 1.
+    void light(const std::string &name, Type type)
+    {
+        std::shared_ptr<Snapshot> next=std::make_shared<Snapshot>(*snapshot());
+        next->lights.emplace_back();
+        next->lights.back().name=name;
+        next->lights.back().type=type;
+        if (type==type_dimmable) next->lights.back().colormode.clear();
+        _snapshot=next;
+    }
+
+    /**
+     * Adds a group with the next ID, starting at 1.
+     *
+     * \param lights    The IDs of the lights
+     * \return          False if a light does not exist
+     */
+    bool group(const std::string &name, const std::vector<size_t> &lights)
+    {
+        std::shared_ptr<Snapshot> next=std::make_shared<Snapshot>(*snapshot());
+        Group g{name, {}};
+        for (size_t id: lights)
+        {
+            if (id<1 || id>next->lights.size()) return false;
+            g.lights.push_back(id-1);
+        }
+        next->groups.push_back(g);
+        _snapshot=next;
+        return true;
+    }
+
+    /// Sets the backend which gets the state changes.
+    void backend(Backend &backend)
+    {
+        _backend=&backend;
+    }
+
+    /// Returns the current state, which stays unchanged while it is held.
+    std::shared_ptr<const Snapshot> snapshot() const
+    {
+        return _snapshot;
+    }
+
+private:
+    void accept()
+    {
+        std::shared_ptr<Session> session=std::make_shared<Session>(*this, _io_service, _stats);
+        _acceptor.async_accept(session->socket(),
+            boost::bind(&Emulator::accepted, this, session, placeholders::error));
+    }
+
+    void accepted(std::shared_ptr<Session> session, const boost::system::error_code &e)
+    {
+        ++_stats.wakeups;
+        if (!e) session->start();
+        accept();
+    }
+
+    /// Handles a complete request.
+    void request(const std::shared_ptr<Session> &session, const HttpMessage &head, const std::string &body)
+    {
+        ++_stats.api_requests;
+        const std::string method(head.method);
+        const std::string path(head.target.substr(0, head.target.find('?')));
+        if (path=="/description.xml" && method=="GET") return session->respond(reply("text/xml", _description));
+
+        std::vector<std::string> parts;
+        std::istringstream segments(path);
+        for (std::string s; std::getline(segments, s, '/'); ) parts.push_back(s);
+        if (parts.size()<2 || !parts[0].empty() || parts[1]!="api")
+            return session->respond("HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+        session->respond(reply("application/json", api(method, parts, body)));
+    }
+
+    /// Handles a request of the API, parts are the segments of the path: "", "api", user, resource, ...
+    std::string api(const std::string &method, const std::vector<std::string> &parts, const std::string &body)
+    {
+        std::string resource;
+        for (size_t i=3; i<parts.size(); ++i) resource+="/"+parts[i];
+        if (resource.empty()) resource="/";
+        const std::shared_ptr<const Snapshot> s=snapshot();
+        const size_t id=parts.size()>4 ? strtoul(parts[4].c_str(), nullptr, 10) : 0;
+
+        if (parts.size()==2)
+        {
+            if (method!="POST") return error(4, "/", "method, "+method+", not available for resource, /");
+            std::string user;
+            for (int i=0; i<2; ++i) user+=(boost::format("%016x")%_random()).str();
+            return "[{\"success\":{\"username\":\""+user+"\"}}]";
+        }
+        if (method=="GET")
+        {
+            if (parts.size()==3)
+                return "{\"lights\":"+lights(*s)+",\"groups\":"+groups(*s)+",\"config\":"+config()+
+                    ",\"schedules\":{},\"scenes\":{},\"rules\":{},\"sensors\":{},\"resourcelinks\":{}}";
+            if (parts[3]=="config" && parts.size()==4) return config();
+            if (parts[3]=="lights" && parts.size()==4) return lights(*s);
+            if (parts[3]=="lights" && parts.size()==5 && id>=1 && id<=s->lights.size()) return light(*s, id-1);
+            if (parts[3]=="groups" && parts.size()==4) return groups(*s);
+            if (parts[3]=="groups" && parts.size()==5 && (parts[4]=="0" || (id>=1 && id<=s->groups.size())))
+                return group(*s, parts[4]=="0" ? 0 : id);
+            return error(3, resource, "resource, "+resource+", not available");
+        }
+        if (method=="PUT" && parts.size()==5 && (parts[3]=="lights" || parts[3]=="groups") && id>=1 &&
+            id<=(parts[3]=="lights" ? s->lights.size() : s->groups.size()))
+            return rename(parts[3]=="lights", id-1, resource, body);
+        if (method=="PUT" && parts.size()==6)
+        {
+            if (parts[3]=="lights" && parts[5]=="state" && id>=1 && id<=s->lights.size())
+                return change({id-1}, resource, body);
+            if (parts[3]=="groups" && parts[5]=="action" && (parts[4]=="0" || (id>=1 && id<=s->groups.size())))
+            {
+                std::vector<size_t> members;
+                if (parts[4]!="0") members=s->groups[id-1].lights;
+                else for (size_t i=0; i<s->lights.size(); ++i) members.push_back(i);
+                return change(members, resource, body);
+            }
+            return error(3, resource, "resource, "+resource+", not available");
+        }
+        return error(4, resource, "method, "+method+", not available for resource, "+resource);
+    }
+
+    /// Renames a light or a group by {"name":"..."}.
+    std::string rename(bool of_light, size_t i, const std::string &address, const std::string &body)
+    {
+        std::vector<std::pair<std::string, std::string>> attributes;
+        if (!Proxy::members(body, attributes) || attributes.empty())
+            return error(2, address, "body contains invalid json");
+        if (attributes.size()!=1 || attributes[0].first!="name")
+            return error(6, address+"/"+attributes[0].first, "parameter, "+attributes[0].first+", not available");
+        const std::string &value=attributes[0].second;
+        if (value.size()<3 || value.front()!='"' || value.back()!='"')
+            return error(7, address+"/name", "invalid value, "+value+", for parameter, name");
+        std::string name;
+        for (size_t j=1; j+1<value.size(); ++j)
+        {
+            if (value[j]=='\\') ++j;
+            name+=value[j];
+        }
+
+        std::shared_ptr<Snapshot> next=std::make_shared<Snapshot>(*snapshot());
+        (of_light ? next->lights[i].name : next->groups[i].name)=name;
+        _snapshot=next;
+        return "[{\"success\":{"+quote(address+"/name")+":"+quote(name)+"}}]";
+    }
+
+    /**
+     * Applies a state change to lights and passes the applied attributes of each light to the backend.
+     *
+     * An attribute of a group action succeeds if one of the lights has it.
+     */
+    std::string change(const std::vector<size_t> &lights, const std::string &address, const std::string &body)
+    {
+        std::vector<std::pair<std::string, std::string>> state;
+        if (!Proxy::members(body, state) || state.empty()) return error(2, address, "body contains invalid json");
+
+        std::shared_ptr<Snapshot> next=std::make_shared<Snapshot>(*snapshot());
+        std::vector<std::vector<std::pair<std::string, std::string>>> applied(lights.size());
+        std::string result="[";
+        for (const auto &a: state)
+        {
+            int type=6;
+            std::pair<std::string, std::string> value;
+            for (size_t j=0; j<lights.size(); ++j)
+            {
+                std::pair<std::string, std::string> v;
+                const int t=apply(next->lights[lights[j]], a.first, a.second, v);
+                if (t)
+                {
+                    if (type) type=t;
+                    continue;
+                }
+                applied[j].push_back(v);
+                value=v;
+                type=0;
+            }
+            if (result.size()>1) result+=",";
+            if (!type)
+                result+="{\"success\":{"+quote(address+"/"+(lights.size()==1 ? value.first : a.first))+":"+
+                    (lights.size()==1 ? value.second : a.second)+"}}";
+            else if (type==6)
+                result+=entry(type, address+"/"+a.first, "parameter, "+a.first+", not available");
+            else
+                result+=entry(type, address+"/"+a.first, "invalid value, "+a.second+", for parameter, "+a.first);
+        }
+        _snapshot=next;
+
+        for (size_t j=0; j<lights.size(); ++j)
+        {
+            if (applied[j].empty()) continue;
+            ++_stats.api_changes;
+            if (_backend) _backend->change(std::to_string(lights[j]+1), Proxy::object(applied[j]));
+        }
+        return result+"]";
+    }
+
+    /**
+     * Applies one attribute of a state change to a light.
+     *
+     * \param applied   Receives the attribute and its JSON value as set, e.g. "bri" and the result of "bri_inc"
+     * \return          0, or the Hue error type: 6 if the light does not have the attribute, 7 for a bad value
+     */
+    static int apply(Light &light, const std::string &key, const std::string &value,
+        std::pair<std::string, std::string> &applied)
+    {
+        char *end;
+        const double n=strtod(value.c_str(), &end);
+        const bool number=!value.empty() && *end=='\0';
+        const bool inc=boost::ends_with(key, "_inc");
+        const std::string name=inc ? key.substr(0, key.size()-4) : key;
+        auto set=[&](int &attribute, int min, int max)
+            {
+                attribute=static_cast<int>(std::max<double>(min, std::min<double>(max, inc ? attribute+n : n)));
+                applied=std::make_pair(name, std::to_string(attribute));
+            };
+
+        if (key=="on")
+        {
+            if (value!="true" && value!="false") return 7;
+            light.on=value=="true";
+            applied=std::make_pair(key, value);
+            return 0;
+        }
+        if (key=="transitiontime" || key=="alert" || key=="effect")
+        {
+            // Only passed to the backend
+            applied=std::make_pair(key, value);
+            return 0;
+        }
+        if (name=="bri")
+        {
+            if (!number) return 7;
+            set(light.bri, 1, 254);
+            return 0;
+        }
+        if (name=="ct" && light.type!=type_dimmable)
+        {
+            if (!number) return 7;
+            set(light.ct, 153, 500);
+            light.colormode="ct";
+            return 0;
+        }
+        if ((name=="hue" || name=="sat") && light.type==type_color)
+        {
+            if (!number) return 7;
+            if (name=="hue") set(light.hue, inc ? -65536 : 0, inc ? 2*65535 : 65535);
+            else set(light.sat, 0, 254);
+            // Increments of the hue wrap around
+            light.hue=(light.hue%65536+65536)%65536;
+            if (name=="hue") applied.second=std::to_string(light.hue);
+            light.colormode="hs";
+            return 0;
+        }
+        if (key=="xy" && light.type==type_color)
+        {
+            double x, y;
+            char close;
+            if (sscanf(value.c_str(), " [ %lf , %lf %c", &x, &y, &close)!=3 || close!=']') return 7;
+            light.x=std::max(0.0, std::min(1.0, x));
+            light.y=std::max(0.0, std::min(1.0, y));
+            applied=std::make_pair(key, (boost::format("[%.4f,%.4f]")%light.x%light.y).str());
+            light.colormode="xy";
+            return 0;
+        }
+        return 6;
+    }
+
+    /// Renders a string as JSON string.
+    static std::string quote(const std::string &s)
+    {
+        std::string q="\"";
+        for (char c: s)
+        {
+            if (c=='"' || c=='\\') q+='\\';
+            if (static_cast<unsigned char>(c)<0x20) q+=(boost::format("\\u%04x")%static_cast<int>(c)).str();
+            else q+=c;
+        }
+        return q+"\"";
+    }
+
+    /// Renders one error of a response.
+    static std::string entry(int type, const std::string &address, const std::string &description)
+    {
+        return "{\"error\":{\"type\":"+std::to_string(type)+",\"address\":"+quote(address)+",\"description\":"+
+            quote(description)+"}}";
+    }
+
+    static std::string error(int type, const std::string &address, const std::string &description)
+    {
+        return "["+entry(type, address, description)+"]";
+    }
+
+    static std::string reply(const std::string &type, const std::string &body)
+    {
+        return "HTTP/1.0 200 OK\r\nContent-Type: "+type+"\r\nContent-Length: "+std::to_string(body.size())+
+            "\r\nConnection: close\r\n\r\n"+body;
+    }
+
+    /// Renders the state attributes the type of the light has.
+    static std::string state(const Light &l)
+    {
+        std::string s="{\"on\":"+std::string(l.on ? "true" : "false")+",\"bri\":"+std::to_string(l.bri);
+        if (l.type==type_color)
+            s+=",\"hue\":"+std::to_string(l.hue)+",\"sat\":"+std::to_string(l.sat)+",\"effect\":\"none\",\"xy\":"+
+                (boost::format("[%.4f,%.4f]")%l.x%l.y).str();
+        if (l.type!=type_dimmable) s+=",\"ct\":"+std::to_string(l.ct)+",\"colormode\":"+quote(l.colormode);
+        return s+",\"alert\":\"none\"";
+    }
+
+    std::string light(const Snapshot &s, size_t i) const
+    {
+        static const char *const types[]={"Dimmable light", "Color temperature light", "Extended color light"};
+        static const char *const models[]={"LWB010", "LTW001", "LCT015"};
+        const Light &l=s.lights[i];
+        const size_t h=std::hash<std::string>()(_uuid);
+        return "{\"state\":"+state(l)+",\"mode\":\"homeautomation\",\"reachable\":true},\"type\":\""+types[l.type]+
+            "\",\"name\":"+quote(l.name)+",\"modelid\":\""+models[l.type]+
+            "\",\"manufacturername\":\"Signify Netherlands B.V.\",\"uniqueid\":\""+
+            (boost::format("00:17:88:01:%02x:%02x:%02x:%02x-0b")%(h>>16&0xff)%(h>>8&0xff)%(h&0xff)%((i+1)&0xff)).str()+
+            "\",\"swversion\":\"1.50.2_r30933\"}";
+    }
+
+    std::string lights(const Snapshot &s) const
+    {
+        std::string json="{";
+        for (size_t i=0; i<s.lights.size(); ++i)
+            json+=(i ? ",\"" : "\"")+std::to_string(i+1)+"\":"+light(s, i);
+        return json+"}";
+    }
+
+    /// Renders group id, 0 are all lights.
+    std::string group(const Snapshot &s, size_t id) const
+    {
+        std::vector<size_t> members;
+        if (id) members=s.groups[id-1].lights;
+        else for (size_t i=0; i<s.lights.size(); ++i) members.push_back(i);
+        std::string ids;
+        bool all=!members.empty(), any=false;
+        for (size_t i: members)
+        {
+            ids+=(ids.empty() ? "\"" : ",\"")+std::to_string(i+1)+"\"";
+            all=all && s.lights[i].on;
+            any=any || s.lights[i].on;
+        }
+        // Like a real bridge, the action shows the state of the first light
+        const std::string action=members.empty() ? "{\"on\":false}" : state(s.lights[members.front()])+"}";
+        return "{\"name\":"+quote(id ? s.groups[id-1].name : "Group 0")+",\"lights\":["+ids+
+            "],\"type\":\"LightGroup\",\"state\":{\"all_on\":"+(all ? "true" : "false")+
+            ",\"any_on\":"+(any ? "true" : "false")+"},\"action\":"+action+"}";
+    }
+
+    std::string groups(const Snapshot &s) const
+    {
+        std::string json="{";
+        for (size_t i=0; i<s.groups.size(); ++i)
+            json+=(i ? ",\"" : "\"")+std::to_string(i+1)+"\":"+group(s, i+1);
+        return json+"}";
+    }
+
+    std::string config() const
+    {
+        return "{\"name\":"+quote(_name)+",\"bridgeid\":"+quote(_bridgeid)+",\"mac\":"+quote(_mac)+
+            ",\"modelid\":\"BSB002\",\"swversion\":\"1941132080\",\"apiversion\":\"1.41.0\","
+            "\"datastoreversion\":\"98\",\"ipaddress\":"+quote(_host)+",\"linkbutton\":true,\"whitelist\":{}}";
+    }
+};
+
+/**
+ * Maps the address of a requester to the bridges advertised to it.
+ *
+ * The routes are kept in a longest prefix match trie, so a lookup costs at most one trie node per address
+ * byte regardless of the number of routes.
+ */
+class Router
+{
+private:
+    std::vector<Responder*> _all;
+    std::vector<std::vector<Responder*>> _routes;
+    LpmTrie<uint32_t> _trie;
+
+public:
+    /// Adds a bridge, which is advertised to all requesters without a route.
+    void add(Responder &resp)
+    {
+        _all.push_back(&resp);
+    }
+
+    /**
+     * Advertises only the given bridges to requesters in subnet.
+     *
+     * \param subnet    The subnet of the requesters
+     * \param bridges   The bridges for those requesters, none denies the subnet
+     */
+    void route(const Subnet &subnet, const std::vector<Responder*> &bridges)
+    {
+        _routes.push_back(bridges);
+        if (subnet.net.is_v4())
+            _trie.insert(subnet.net.to_v4().to_bytes().data(), 4, subnet.len, _routes.size()-1);
+        else
+            _trie.insert(subnet.net.to_v6().to_bytes().data(), 16, subnet.len, _routes.size()-1);
+    }
+
+    /// Returns all bridges.
+    const std::vector<Responder*> &all() const
+    {
+        return _all;
+    }
+
+    /// Returns the bridges to advertise to the requester addr.
+    const std::vector<Responder*> &operator()(const ip::address &addr) const
+    {
+        const uint32_t *r=addr.is_v4() ? _trie.find(addr.to_v4().to_bytes().data(), 4) :
+            _trie.find(addr.to_v6().to_bytes().data(), 16);
+        return r ? _routes[*r] : _all;
+    }
+};
+
+/**
+ * Admission control for searches under overload.
+ *
+ * An outbound token bucket limits the response telegrams per second. Each priority class leaves a reserve
+ * of the bucket to the classes above it, unknown requesters can not use the last quarter and learned
+ * controllers the last eighth, so a broadcast storm is shed before the known controllers starve. A search
+ * which costs more telegrams than are left above the reserve is admitted with a full bucket and leaves it
+ * in debt, so a rate below the telegrams of one search throttles the searches instead of shedding all.
+ *
+ * A requester is learned if it is answered by two searches at least #_learn_interval apart while the
+ * bucket is at least half full. Controllers like the Echo search repeatedly over time, so they are learned
+ * before a storm begins, while the sources of a storm never get two calm searches.
+ */
+class Admission
+{
+private:
+    /// A requester which was answered while the bucket was calm
+    struct Seen
+    {
+        boost::posix_time::ptime first;     ///< First calm search
+        boost::posix_time::ptime last;      ///< Last admitted search, the oldest entry is dropped first
+        bool learned;
+    };
+    LpmTrie<bool> _known;
+    std::map<ip::address, Seen> _seen;
+    static const size_t _max_seen=256;
+    const boost::posix_time::seconds _learn_interval;
+    double _rate;
+    double _tokens;
+    boost::posix_time::ptime _last;
+    Statistics &_stats;
+
+public:
+    Admission(Statistics &stats) :
+        _learn_interval(10), _rate(0), _tokens(0), _last(boost::posix_time::microsec_clock::universal_time()),
+        _stats(stats)
+    {
+    }
+
+    /// Adds a subnet of configured controllers.
+    void known(const Subnet &subnet)
+    {
+        if (subnet.net.is_v4())
+            _known.insert(subnet.net.to_v4().to_bytes().data(), 4, subnet.len, true);
+        else
+            _known.insert(subnet.net.to_v6().to_bytes().data(), 16, subnet.len, true);
+    }
+
+    /// Limits the response telegrams per second, 0 means no limit.
+    void rate(uint32_t rate)
+    {
+        _rate=rate;
+        _tokens=rate;
+    }
+
+    /// Returns the priority class of the requester addr.
+    Priority priority(const ip::address &addr) const
+    {
+        const bool *k=addr.is_v4() ? _known.find(addr.to_v4().to_bytes().data(), 4) :
+            _known.find(addr.to_v6().to_bytes().data(), 16);
+        if (k && *k) return prio_configured;
+        const auto seen=_seen.find(addr);
+        return seen!=_seen.end() && seen->second.learned ? prio_learned : prio_unknown;
+    }
+
+    /**
+     * Decides if a search gets responses.
+     *
+     * \param addr      The address of the requester
+     * \param prio      The result of priority(addr)
+     * \param cost      The number of response telegrams for this search
+     * \return          False if the search has to be shed, the shed counters are already updated.
+     */
+    bool admit(const ip::address &addr, Priority prio, unsigned cost)
+    {
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        bool calm=true;
+        if (_rate)
+        {
+            _tokens=std::min(_rate, _tokens+_rate*(now-_last).total_microseconds()/1e6);
+            _last=now;
+            const double reserve=_rate*(prio_configured-prio)/8;
+            if (_tokens<std::min(static_cast<double>(cost), _rate-reserve)+reserve)
+            {
+                ++(prio==prio_unknown ? _stats.shed_unknown : _stats.shed_known);
+                return false;
+            }
+            _tokens-=cost;
+            calm=_tokens>=_rate/2;
+        }
+
+        auto seen=_seen.find(addr);
+        if (seen!=_seen.end())
+        {
+            seen->second.last=now;
+            if (calm && now-seen->second.first>=_learn_interval) seen->second.learned=true;
+        }
+        else if (calm)
+        {
+            // Drop the longest unseen requester if the table is full
+            if (_seen.size()>=_max_seen)
+                _seen.erase(std::min_element(_seen.begin(), _seen.end(),
+                    [](const std::pair<const ip::address, Seen> &a, const std::pair<const ip::address, Seen> &b)
+                    { return a.second.last<b.second.last; }));
+            _seen.emplace(addr, Seen{now, now, false});
+        }
+        return true;
+    }
+};
+
+/**
+ * Coordinates several hued instances on one segment, so that only the leader answers searches.
+ *
+ * Each instance sends a heartbeat with its rank (the configured priority, ties broken by a random ID, the
+ * higher wins) to a private multicast group every heartbeat interval. Instances of another rank hold a lease
+ * of one and a half intervals from their last heartbeat, not of one interval: the extra half interval
+ * absorbs a heartbeat delayed by the network or the event loop, which would otherwise make two leaders.
+ * An instance is the leader while it holds no lease of a higher ranked peer, the others are standbys which
+ * receive and classify the searches and keep their caches warm, but do not answer. A new instance stands
+ * by for one lease period to learn its peers first. When the leader stops sending heartbeats the best
+ * standby takes over when its lease expires, and an instance which leaves (see leave()) says so, so the
+ * standby takes over right away. The multicast loop is on, so instances on the same host coordinate the
+ * same way.
+ */
+class Coordinator
+{
+private:
+    Statistics &_stats;
+    Log *_log=nullptr;
+    ip::udp::socket _socket;
+    const ip::udp::endpoint _group;
+    deadline_timer _heartbeat;
+    deadline_timer _lease;
+    boost::posix_time::time_duration _interval;
+    uint64_t _rank;
+    bool _leader;
+    boost::container::flat_map<uint64_t, boost::posix_time::ptime> _peers;  ///< Last heartbeat by rank
+    ip::udp::endpoint _sender_endpoint;
+    static const uint16_t _max_length=64;
+    char _data[_max_length];
+
+public:
+    /**
+     * The constructor joins the group, starts the heartbeats and stands by for the first lease period.
+     *
+     * \param group     The multicast group and port of the instances, e.g. 239.255.72.1:1901
+     * \param priority  The instance with the highest priority leads
+     * \param interval  The heartbeat interval
+     */
+    Coordinator(io_service &io_service, Statistics &stats, const ip::udp::endpoint &group, uint32_t priority,
+        boost::posix_time::time_duration interval) :
+        _stats(stats), _socket(io_service), _group(group), _heartbeat(io_service), _lease(io_service),
+        _interval(interval), _leader(false)
+    {
+        // A higher ID wins between equal priorities
+        _rank=static_cast<uint64_t>(priority)<<32|(std::random_device()()&0xffffffff);
+
+        const ip::udp::endpoint listen_endpoint(group.address().is_v4() ?
+            ip::address(ip::address_v4::any()) : ip::address(ip::address_v6::any()), group.port());
+        _socket.open(listen_endpoint.protocol());
+        _socket.set_option(ip::udp::socket::reuse_address(true));
+        _socket.bind(listen_endpoint);
+        _socket.set_option(ip::multicast::join_group(group.address()));
+        _socket.set_option(ip::multicast::hops(1));
+        _socket.set_option(ip::multicast::enable_loopback(true));
+
+        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
+            boost::bind(&Coordinator::receive, this, placeholders::error, placeholders::bytes_transferred));
+        beat(boost::system::error_code());
+        _lease.expires_from_now(lease());
+        _lease.async_wait(boost::bind(&Coordinator::expired, this, placeholders::error));
+    }
+
+    /// Returns true if this instance answers the searches.
+    bool leader() const
+    {
+        return _leader;
+    }
+
+    /// Logs the changes of the role to log.
+    void log(Log &log)
+    {
+        _log=&log;
+    }
+
+    /// Tells the peers that this instance leaves, so a standby takes over immediately.
+    void leave()
+    {
+        boost::system::error_code ignored;
+        _socket.send_to(buffer((boost::format("hued %016x bye")%_rank).str()), _group, 0, ignored);
+    }
+
+private:
+    boost::posix_time::time_duration lease() const
+    {
+        return _interval*3/2;
+    }
+
+    void beat(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        boost::system::error_code ignored;
+        _socket.send_to(buffer((boost::format("hued %016x")%_rank).str()), _group, 0, ignored);
+        _heartbeat.expires_from_now(_interval);
+        _heartbeat.async_wait(boost::bind(&Coordinator::beat, this, placeholders::error));
+    }
+
+    void receive(const boost::system::error_code &error, size_t bytes)
+    {
+        if (error) return;
+        ++_stats.wakeups;
+
+        uint64_t rank;
+        char bye[4]="";
+        _data[std::min<size_t>(bytes, _max_length-1)]=0;
+        if (sscanf(_data, "hued %16" SCNx64 " %3s", &rank, bye)>=1 && rank!=_rank)
+        {
+            if (strcmp(bye, "bye")==0) _peers.erase(rank);
+            else _peers[rank]=boost::posix_time::microsec_clock::universal_time();
+            if (rank>_rank) update();
+        }
+
+        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
+            boost::bind(&Coordinator::receive, this, placeholders::error, placeholders::bytes_transferred));
+    }
+
+    void expired(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        update();
+    }
+
+    /// Drops the expired leases, decides the role and waits for the next lease of a higher peer to expire.
+    void update()
+    {
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        boost::posix_time::ptime next;
+        for (auto p=_peers.begin(); p!=_peers.end(); )
+        {
+            if (p->second+lease()<=now)
+                p=_peers.erase(p);
+            else
+            {
+                if (p->first>_rank && (next.is_not_a_date_time() || p->second+lease()<next)) next=p->second+lease();
+                ++p;
+            }
+        }
+
+        const bool leader=next.is_not_a_date_time();
+        if (leader!=_leader)
+        {
+            _leader=leader;
+            if (leader) ++_stats.takeovers;
+            std::cerr << (leader ? "Taking over as leader." : "Standing by for a peer.") << std::endl;
+            if (_log) _log->push(Log::event_leader, nullptr, 0, 0, leader);
+        }
+        if (leader)
+            _lease.cancel();
+        else
+        {
+            _lease.expires_at(next);
+            _lease.async_wait(boost::bind(&Coordinator::expired, this, placeholders::error));
+        }
+    }
+};
+
+/**
+ * Emulates a farm of virtual bridges, e.g. to load test controllers with thousands of bridges.
+ *
+ * The identities are kept in a table of structures of arrays: per bridge only the lower 24 bits of its
+ * MAC address (below the Signify OUI 00:17:88) and a download counter are stored, everything else is
+ * derived when needed. The UUID is 2f402f80-da50-11e1-9b23- followed by the MAC like on real bridges,
+ * the bridge ID is the MAC with FFFE in the middle. The MACs are spread by an odd stride, so they are
+ * unique and the same for each run. The description.xml of bridge i is generated on request at
+ * /farm/i/description.xml of the HttpServer.
+ *
+ * The three telegrams of each bridge are spread evenly over the MX of the search and rendered into a
+ * batch buffer, which is sent by one sendmmsg() per #_batch telegrams.
+ */
+class Farm
+{
+private:
+    /// A search being answered
+    struct Search
+    {
+        ip::udp::endpoint requester;
+        boost::posix_time::ptime start;
+        uint32_t mx;        ///< In milliseconds
+        size_t next;        ///< The next telegram, bridge next/3 and telegram next%3 of it
+    };
+    /// The rendered segments of one telegram, see Responder::message()
+    struct Telegram
+    {
+        char location[96];
+        char bridgeid[48];
+        char st[160];
+        iovec iov[5];
+    };
+    static constexpr size_t _batch=64;
+    static const uint32_t _oui=0x001788;
+
+    std::vector<uint32_t> _mac;     ///< Lower 24 bits of the MAC address of each bridge
+    std::vector<uint32_t> _fetches; ///< Downloads of the description.xml of each bridge
+    std::string _host;
+    uint16_t _port;
+    ip::udp::socket _socket;
+    deadline_timer _timer;
+    std::deque<Search> _searches;
+    Telegram _telegrams[_batch];
+    mmsghdr _headers[_batch];
+    Statistics &_stats;
+
+public:
+    /**
+     * The constructor creates the identities and serves their description.xml by http.
+     *
+     * \param count     The number of bridges, at most 2^24
+     * \param host      The host of the HttpServer advertised in the LOCATION
+     */
+    Farm(io_service &io_service, size_t count, HttpServer &http, const std::string &host, uint16_t port,
+        Statistics &stats) :
+        _mac(count), _fetches(count), _host(host), _port(port), _socket(io_service, ip::udp::v4()),
+        _timer(io_service), _stats(stats)
+    {
+        for (size_t i=0; i<count; ++i) _mac[i]=(0x255acc+i*0x9e3779)&0xffffff;
+        http.generator("/farm/", [this](const std::string &path, std::string &type, std::string &body)
+            {
+                return describe(path, type, body);
+            });
+        memset(_headers, 0, sizeof(_headers));
+        for (size_t i=0; i<_batch; ++i)
+        {
+            _headers[i].msg_hdr.msg_iov=_telegrams[i].iov;
+            _headers[i].msg_hdr.msg_iovlen=5;
+            _telegrams[i].iov[0]={const_cast<char*>(HUE_RESPONSE), sizeof(HUE_RESPONSE)-1};
+            _telegrams[i].iov[2]={const_cast<char*>(HUE_SERVER), sizeof(HUE_SERVER)-1};
+        }
+    }
+
+    /// The number of bridges
+    size_t size() const
+    {
+        return _mac.size();
+    }
+
+    /// Answers a search with the telegrams of all bridges, spread over mx seconds.
+    void operator()(const ip::udp::endpoint &requester, uint16_t mx)
+    {
+        _searches.push_back(Search{requester, boost::posix_time::microsec_clock::universal_time(), mx*1000u, 0});
+        if (_searches.size()==1) send(boost::system::error_code());
+    }
+
+private:
+    /// Returns the UUID of bridge i.
+    std::string uuid(size_t i) const
+    {
+        char uuid[37];
+        snprintf(uuid, sizeof(uuid), "2f402f80-da50-11e1-9b23-%06x%06x", _oui, _mac[i]);
+        return uuid;
+    }
+
+    /// Generates the description.xml for the path /farm/i/description.xml.
+    bool describe(const std::string &path, std::string &type, std::string &body)
+    {
+        char tail[32]="";
+        unsigned long i;
+        if (sscanf(path.c_str(), "/farm/%lu%31s", &i, tail)!=2 || i>=_mac.size() ||
+            strcmp(tail, "/description.xml")!=0)
+            return false;
+        // The first download of a bridge means a controller got through to it
+        if (!_fetches[i]++) ++_stats.farm_bridges_fetched;
+        ++_stats.farm_fetches;
+        char serial[13];
+        snprintf(serial, sizeof(serial), "%06x%06x", _oui, _mac[i]);
+        type="text/xml";
+        body=(boost::format(HUE_DESCRIPTION)%_host%_port%("Philips hue "+std::to_string(i))%serial%uuid(i)).str();
+        return true;
+    }
+
+    /// Sends the telegrams which are due and waits for the next ones.
+    void send(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        const size_t total=3*_mac.size();
+        for (auto s=_searches.begin(); s!=_searches.end(); )
+        {
+            const int64_t elapsed=(now-s->start).total_milliseconds();
+            const size_t due=elapsed>=s->mx ? total : total*elapsed/s->mx;
+            while (s->next<due)
+            {
+                const size_t n=std::min(due-s->next, _batch);
+                for (size_t k=0; k<n; ++k) render(s->next+k, s->requester, k);
+                // A failed batch is dropped like a lost datagram
+                const int sent=sendmmsg(_socket.native_handle(), _headers, n, 0);
+                s->next+=sent>0 ? sent : n;
+                if (sent>0) _stats.responses+=sent;
+            }
+            if (s->next>=total) s=_searches.erase(s);
+            else ++s;
+        }
+
+        if (_searches.empty()) return;
+        _timer.expires_from_now(boost::posix_time::milliseconds(10));
+        _timer.async_wait(boost::bind(&Farm::send, this, placeholders::error));
+    }
+
+    /// Renders telegram j of the farm into slot k of the batch.
+    void render(size_t j, const ip::udp::endpoint &requester, size_t k)
+    {
+        const size_t i=j/3;
+        Telegram &t=_telegrams[k];
+        const std::string id=uuid(i);
+        const int location=snprintf(t.location, sizeof(t.location), "LOCATION: http://%s:%u/farm/%zu/description.xml\r\n",
+            _host.c_str(), _port, i);
+        const int bridgeid=snprintf(t.bridgeid, sizeof(t.bridgeid), "hue-bridgeid: %06XFFFE%06X\r\n",
+            _oui, _mac[i]);
+        const int st=(boost::format(j%3==0 ? HUE_ST1 : j%3==1 ? HUE_ST2 : HUE_ST3)%id).str().copy(t.st, sizeof(t.st));
+        t.iov[1]={t.location, std::min<size_t>(location, sizeof(t.location)-1)};
+        t.iov[3]={t.bridgeid, std::min<size_t>(bridgeid, sizeof(t.bridgeid)-1)};
+        t.iov[4]={t.st, static_cast<size_t>(st)};
+        _headers[k].msg_hdr.msg_name=const_cast<sockaddr*>(requester.data());
+        _headers[k].msg_hdr.msg_namelen=requester.size();
+    }
+};
+
+/**
+ * Measures the end-to-end discovery latency by searching for the bridges like a controller.
+ *
+ * Every interval the canary sends an M-SEARCH with MX 0 from each IPv4 interface which is up and capable of
+ * multicast, and takes the time until the first response of one of the bridges hued advertises arrives,
+ * recognized by its USN, so other bridges on the segment do not mask a failure of hued. With fetch the
+ * LOCATION of that response is downloaded as well and the probe ends with the download. A probe without
+ * result before the next one fails, so a lost multicast membership, a firewall change or an unreachable
+ * bridge is noticed on its own. The interfaces are enumerated again for each round. The Listener answers
+ * the searches of the canary (see own()) without counting, admitting or learning them.
+ */
+class Canary
+{
+private:
+    /// The probe of one interface
+    struct Probe
+    {
+        std::string ifname;
+        ip::address_v4 addr;
+        ip::udp::socket socket;
+        ip::udp::endpoint local;        ///< The bound address and port of socket
+        boost::posix_time::ptime sent;  ///< Not a date time while no probe is outstanding
+        bool fetching=false;            ///< The LOCATION of a response to the outstanding probe is downloaded
+        bool failing=false;
+        ip::udp::endpoint sender_endpoint;
+        char data[1024];
+
+        Probe(io_service &io_service, const std::string &ifname, const ip::address_v4 &addr) :
+            ifname(ifname), addr(addr), socket(io_service)
+        {
+        }
+    };
+
+    io_service &_io_service;
+    deadline_timer _timer;
+    boost::posix_time::time_duration _interval;
+    bool _fetch;
+    std::vector<std::shared_ptr<Probe>> _probes;
+    const Router &_router;
+    Statistics &_stats;
+
+public:
+    /**
+     * \param router    The bridges whose responses count
+     * \param interval  The time between two probes, also the timeout of a probe
+     * \param fetch     Download the description.xml of the first response too
+     */
+    Canary(io_service &io_service, Statistics &stats, const Router &router, boost::posix_time::time_duration interval,
+        bool fetch) :
+        _io_service(io_service), _timer(io_service), _interval(interval), _fetch(fetch), _router(router), _stats(stats)
+    {
+        expired(boost::system::error_code());
+    }
+
+    /// Checks if a datagram from sender is a search of the canary.
+    bool own(const ip::udp::endpoint &sender) const
+    {
+        for (const std::shared_ptr<Probe> &p: _probes)
+            if (p->local==sender) return true;
+        return false;
+    }
+
+private:
+    /// Evaluates the previous round and sends the next.
+    void expired(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+
+        for (const std::shared_ptr<Probe> &p: _probes)
+        {
+            if (p->sent.is_not_a_date_time()) continue;
+            p->sent=boost::posix_time::ptime();
+            ++_stats.canary_failures;
+            if (!p->failing) std::cerr << "Canary on " << p->ifname << ": no bridge found." << std::endl;
+            p->failing=true;
+        }
+        interfaces();
+
+        static const char search[]="M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\n"
+            "MX: 0\r\nST: urn:schemas-upnp-org:device:Basic:1\r\n\r\n";
+        const ip::udp::endpoint group(ip::address::from_string("239.255.255.250"), multicast_port);
+        for (const std::shared_ptr<Probe> &p: _probes)
+        {
+            boost::system::error_code error;
+            p->sent=boost::posix_time::microsec_clock::universal_time();
+            p->fetching=false;
+            p->socket.send_to(buffer(search, sizeof(search)-1), group, 0, error);
+            ++_stats.canary_probes;
+        }
+
+        _timer.expires_from_now(_interval);
+        _timer.async_wait(boost::bind(&Canary::expired, this, placeholders::error));
+    }
+
+    /// Opens a socket for each new interface and closes those of vanished interfaces.
+    void interfaces()
+    {
+        ifaddrs *list;
+        if (getifaddrs(&list)!=0) return;
+        std::vector<std::shared_ptr<Probe>> probes;
+        for (const ifaddrs *i=list; i; i=i->ifa_next)
+        {
+            if (!i->ifa_addr || i->ifa_addr->sa_family!=AF_INET || (i->ifa_flags&IFF_LOOPBACK) ||
+                (i->ifa_flags&(IFF_UP|IFF_MULTICAST))!=(IFF_UP|IFF_MULTICAST))
+                continue;
+            const ip::address_v4 addr(ntohl(reinterpret_cast<const sockaddr_in*>(i->ifa_addr)->sin_addr.s_addr));
+            auto p=std::find_if(_probes.begin(), _probes.end(), [&](const std::shared_ptr<Probe> &p)
+                { return p && p->ifname==i->ifa_name && p->addr==addr; });
+            if (p!=_probes.end())
+            {
+                probes.push_back(std::move(*p));
+                continue;
+            }
+
+            std::shared_ptr<Probe> probe(new Probe(_io_service, i->ifa_name, addr));
+            boost::system::error_code error;
+            probe->socket.open(ip::udp::v4(), error);
+            if (!error) probe->socket.bind(ip::udp::endpoint(addr, 0), error);
+            if (!error) probe->socket.set_option(ip::multicast::outbound_interface(addr), error);
+            if (!error) probe->local=probe->socket.local_endpoint(error);
+            if (error)
+            {
+                std::cerr << "Canary on " << i->ifa_name << ": " << error.message() << std::endl;
+                continue;
+            }
+            receive(probe);
+            probes.push_back(std::move(probe));
+        }
+        freeifaddrs(list);
+        // The pending receives keep the dropped probes alive until their sockets are closed
+        for (const std::shared_ptr<Probe> &p: _probes)
+            if (p) p->socket.close();
+        _probes.swap(probes);
+    }
+
+    void receive(const std::shared_ptr<Probe> &p)
+    {
+        p->socket.async_receive_from(buffer(p->data, sizeof(p->data)), p->sender_endpoint,
+            [this, p](const boost::system::error_code &error, size_t bytes)
+            {
+                if (error) return;
+                ++_stats.wakeups;
+                received(p, std::string_view(p->data, bytes));
+                receive(p);
+            });
+    }
+
+    /// Checks if the USN of a response is one of a bridge hued advertises.
+    bool advertised(std::string_view response) const
+    {
+        const size_t usn=response.find("\r\nUSN: uuid:");
+        if (usn==std::string_view::npos) return false;
+        const size_t begin=usn+12, end=response.find_first_of(":\r", begin);
+        if (end==std::string_view::npos) return false;
+        const std::string_view uuid=response.substr(begin, end-begin);
+        for (const Responder *resp: _router.all())
+            if (resp->uuid()==uuid) return true;
+        return false;
+    }
+
+    /// Takes the time of the first response of an advertised bridge to the outstanding probe.
+    void received(const std::shared_ptr<Probe> &p, std::string_view response)
+    {
+        if (p->sent.is_not_a_date_time() || p->fetching ||
+            response.find("\r\nhue-bridgeid:")==std::string_view::npos || !advertised(response))
+            return;
+        if (!_fetch) return found(*p);
+
+        // The LOCATION has the form http://host[:port]/path, a probe with a broken one fails
+        const size_t location=response.find("\r\nLOCATION: http://");
+        if (location==std::string_view::npos) return;
+        const size_t host=location+19, end=response.find("\r\n", host);
+        const size_t slash=response.find('/', host), colon=response.find(':', host);
+        if (end==std::string_view::npos || slash>end) return;
+        p->fetching=true;
+        const boost::posix_time::ptime sent=p->sent;
+        Download::start(_io_service, std::string(response.substr(host, std::min(colon, slash)-host)),
+            colon<slash ? std::string(response.substr(colon+1, slash-colon-1)) : std::string("80"),
+            std::string(response.substr(slash, end-slash)),
+            [this, p, sent](const boost::system::error_code &e, const std::string &)
+            {
+                // Downloads which finish after the next probe was sent are too late
+                if (p->sent!=sent || !p->socket.is_open()) return;
+                p->fetching=false;
+                if (!e) found(*p);
+            }, _stats, _interval);
+    }
+
+    /// Ends the outstanding probe successfully.
+    void found(Probe &p)
+    {
+        const uint64_t latency=(boost::posix_time::microsec_clock::universal_time()-p.sent).total_microseconds();
+        p.sent=boost::posix_time::ptime();
+        ++_stats.canary_found;
+        _stats.canary_latency_sum+=latency;
+        _stats.canary_latency_max=std::max(_stats.canary_latency_max, latency);
+        if (p.failing) std::cerr << "Canary on " << p.ifname << ": bridges found again." << std::endl;
+        p.failing=false;
+    }
+};
+
+/// SSDP Listener
+class Listener
+{
+private:
+    io_service &_io_service;
+    Router &_router;
+    Admission &_admission;
+    Statistics &_stats;
+    const Coordinator *_coordinator=nullptr;
+    const Canary *_canary=nullptr;
+    Farm *_farm=nullptr;
+    Log *_log=nullptr;
+    ip::udp::socket _socket;
+    std::unique_ptr<XdpSocket> _xdp;
+    std::unique_ptr<posix::stream_descriptor> _xdp_wait;    ///< Waits for the AF_XDP socket, owns a duplicate
+    static const uint16_t _max_length=1024;
+    static constexpr unsigned _batch=16;    ///< Datagrams received by one recvmmsg()
+    char _data[_batch][_max_length];
+    sockaddr_storage _senders[_batch];
+    iovec _iov[_batch];
+    mmsghdr _messages[_batch];
+
+public:
+    /**
+     * The constructor opens the SSDP port for listening, joins the multicast group and starts listening.
+     */
+    Listener(io_service &io_service, Router &router, Admission &admission, Statistics &stats,
+        const ip::address &listen_address, const ip::address &multicast_address) :
+        _io_service(io_service), _router(router), _admission(admission), _stats(stats), _socket(io_service)
+    {
+        // Create the socket so that multiple may be bound to the same address.
+        ip::udp::endpoint listen_endpoint(listen_address, multicast_port);
+        _socket.open(listen_endpoint.protocol());
+        _socket.set_option(ip::udp::socket::reuse_address(true));
+        _socket.bind(listen_endpoint);
+
+        // Join the multicast group.
+        _socket.set_option(ip::multicast::join_group(multicast_address));
+
+        memset(_messages, 0, sizeof(_messages));
+        for (unsigned i=0; i<_batch; ++i)
+        {
+            _iov[i].iov_base=_data[i];
+            _iov[i].iov_len=_max_length;
+            _messages[i].msg_hdr.msg_name=&_senders[i];
+            _messages[i].msg_hdr.msg_iov=&_iov[i];
+            _messages[i].msg_hdr.msg_iovlen=1;
+        }
+        _socket.async_wait(ip::udp::socket::wait_read, boost::bind(&Listener::receive, this, placeholders::error));
+    }
+
+    /**
+     * Busy polls the device queue for up to usec microseconds when waiting for datagrams (SO_BUSY_POLL).
+     * Values above net.core.busy_read need CAP_NET_ADMIN.
+     *
+     * \return  False if the kernel refused the option.
+     */
+    bool busy_poll(int usec)
+    {
+        return setsockopt(_socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))==0;
+    }
+
+    /// Answers the searches only while coordinator says this instance leads.
+    void coordinator(const Coordinator &coordinator)
+    {
+        _coordinator=&coordinator;
+    }
+
+    /// Answers the searches of canary without counting, admitting or learning them.
+    void canary(const Canary &canary)
+    {
+        _canary=&canary;
+    }
+
+    /// Answers the searches of all requesters for the bridges of farm as well.
+    void farm(Farm &farm)
+    {
+        _farm=&farm;
+    }
+
+    /// Logs the searches and why they were not answered to log.
+    void log(Log &log)
+    {
+        _log=&log;
+    }
+
+    /**
+     * Receives the searches on queue 0 of the interface ifname by an AF_XDP socket, see XdpSocket. Immediate
+     * responses to searches received there are sent through its TX ring. The UDP socket keeps serving
+     * all other interfaces and queues.
+     *
+     * \throws std::runtime_error if AF_XDP is not available, the UDP socket is not affected then.
+     */
+    void xdp(const std::string &ifname)
+    {
+        _xdp.reset(new XdpSocket(ifname, multicast_port));
+        _xdp_wait.reset(new posix::stream_descriptor(_io_service, dup(_xdp->fd())));
+        _xdp_wait->async_wait(posix::stream_descriptor::wait_read,
+            boost::bind(&Listener::xdp_receive, this, placeholders::error));
+    }
+
+    /**
+     * Receives up to #_batch datagrams by one recvmmsg() and evaluates them as a batch.
+     *
+     * @param error     If this error code says anything other than OK then the function returns immediately.
+     */
+    void receive(const boost::system::error_code &error)
+    {
+        if (error) return;
+        ++_stats.wakeups;
+
+        for (unsigned i=0; i<_batch; ++i) _messages[i].msg_hdr.msg_namelen=sizeof(_senders[i]);
+        const int n=recvmmsg(_socket.native_handle(), _messages, _batch, MSG_DONTWAIT, nullptr);
+        _socket.async_wait(ip::udp::socket::wait_read, boost::bind(&Listener::receive, this, placeholders::error));
+        if (n<=0) return;
+
+        std::string_view datagrams[_batch];
+        Search searches[_batch];
+        bool found[_batch];
+        for (int i=0; i<n; ++i) datagrams[i]=std::string_view(_data[i], _messages[i].msg_len);
+        if (!classify(datagrams, n, searches, found)) return;
+        for (int i=0; i<n; ++i)
+        {
+            if (!found[i]) continue;
+            ip::udp::endpoint sender;
+            memcpy(sender.data(), &_senders[i], _messages[i].msg_hdr.msg_namelen);
+            sender.resize(_messages[i].msg_hdr.msg_namelen);
+            answer(sender.address(), sender.port(), searches[i]);
+        }
+    }
+
+private:
+    /// Handles the frames of the AF_XDP socket.
+    void xdp_receive(const boost::system::error_code &error)
+    {
+        if (error) return;
+        ++_stats.wakeups;
+
+        _stats.xdp_frames+=_xdp->receive([this](uint32_t saddr, uint16_t sport, const char *data, size_t bytes)
+            {
+                handle(ip::address_v4(ntohl(saddr)), sport, data, bytes, _xdp.get());
+            });
+        _xdp_wait->async_wait(posix::stream_descriptor::wait_read,
+            boost::bind(&Listener::xdp_receive, this, placeholders::error));
+    }
+
+    /**
+     * Evaluates a datagram received by the AF_XDP socket direct, see answer().
+     *
+     * @param addr      The address of the sender
+     * @param port      The port of the sender
+     * @param data      The UDP payload
+     * @param bytes     Number of bytes of data
+     * @param direct    The AF_XDP socket the datagram was received on
+     */
+    void handle(const ip::address &addr, uint16_t port, const char *data, size_t bytes, XdpSocket *direct)
+    {
+        Search search;
+        if (classify(data, bytes, search)) answer(addr, port, search, direct);
+    }
+
+    /**
+     * Answers an M-SEARCH, which classify() found in a datagram.
+     *
+     * The function checks, if the requested service type ("ST:") is a supported type for HUE bridge
+     * devices. If yes, then the function triggers a response of each bridge routed to the sender to the
+     * same address and port the SSDP datagram was received on, after the response timeout ("MX:").
+     *
+     * @param addr      The address of the sender
+     * @param port      The port of the sender
+     * @param search    The headers of the search
+     * @param direct    The AF_XDP socket the datagram was received on, if any
+     */
+    void answer(const ip::address &addr, uint16_t port, const Search &search, XdpSocket *direct=nullptr)
+    {
+        // Is this a supported service type?
+        if (service_types.find(search.st)==service_types.end()) return;
+        // The searches of our own canary measure the responses, they are no demand of a controller
+        if (_canary && _canary->own(ip::udp::endpoint(addr, port)))
+            return answer_canary(addr, port, search, direct);
+        ++_stats.searches;
+        if (_coordinator && !_coordinator->leader())
+        {
+            ++_stats.standby;
+            record(Log::event_standby, addr, port);
+            return;
+        }
+
+        try
+        {
+            const uint16_t mx=boost::lexical_cast<uint16_t>(search.mx.data(), search.mx.size());
+            const std::vector<Responder*> &bridges=_router(addr);
+            if (bridges.empty() && !_farm)
+            {
+                ++_stats.denied;
+                record(Log::event_denied, addr, port);
+                return;
+            }
+            const Priority prio=_admission.priority(addr);
+            if (!_admission.admit(addr, prio, 3*(bridges.size()+(_farm ? _farm->size() : 0))))
+            {
+                record(Log::event_shed, addr, port, prio);
+                return;
+            }
+            record(Log::event_search, addr, port, mx, bridges.size()+(_farm ? _farm->size() : 0));
+            for (Responder *resp: bridges)
+                (*resp)(addr, port, mx, prio, direct);
+            if (_farm && addr.is_v4()) (*_farm)(ip::udp::endpoint(addr, port), mx);
+        }
+        catch(const boost::bad_lexical_cast &)
+        {
+        }
+    }
+
+    /// Answers a search of the canary like one of a configured controller, unless this instance stands by.
+    void answer_canary(const ip::address &addr, uint16_t port, const Search &search, XdpSocket *direct)
+    {
+        if (_coordinator && !_coordinator->leader()) return;
+        try
+        {
+            const uint16_t mx=boost::lexical_cast<uint16_t>(search.mx.data(), search.mx.size());
+            for (Responder *resp: _router(addr))
+                (*resp)(addr, port, mx, prio_configured, direct);
+        }
+        catch(const boost::bad_lexical_cast &)
+        {
+        }
+    }
+
+    /// Logs an event of the requester addr, if logging is enabled.
+    void record(Log::Event event, const ip::address &addr, uint16_t port, uint32_t arg0=0, uint32_t arg1=0)
+    {
+        if (!_log) return;
+        if (addr.is_v4())
+            _log->push(event, addr.to_v4().to_bytes().data(), 4, port, arg0, arg1);
+        else
+            _log->push(event, addr.to_v6().to_bytes().data(), 16, port, arg0, arg1);
+    }
+};
+
+/**
+ * mDNS (DNS-SD) responder, which advertises the bridges as _hue._tcp.local services.
+ *
+ * Current Hue apps discover bridges by mDNS instead of SSDP. For each bridge the responder answers with
+ * the service instance "Philips Hue - XXXXXX" (the last six digits of the bridge ID), its SRV record
+ * pointing to the port of the bridge at the host "hue-<bridge id>.local", its TXT record with bridgeid
+ * and modelid and the A record of that host with the IPv4 address of the bridge. The answer packets are
+ * rendered when the identity or the server of a bridge changed and announced by multicast once, queries
+ * only select and send them. The bridges are checked for changes every t_refresh_min seconds and on each
+ * query. Routes and the admission control apply like for SSDP.
+ *
+ * Queries which list our PTR record with at least half its TTL as known answer get no answer for that
+ * bridge. Multicast answers of a bridge are sent at most once per second. Queries with the QU bit get
+ * unicast answers, legacy resolvers (source port other than 5353) too, with the query ID, the question
+ * and a TTL of 10 seconds.
+ */
+class MdnsResponder
+{
+private:
+    enum
+    {
+        type_a=1,
+        type_ptr=12,
+        type_txt=16,
+        type_srv=33,
+        type_any=255,
+        class_in=1,
+        class_flush=0x8000,     ///< Cache flush bit of unique records, QU bit of questions
+        ttl_host=120,           ///< TTL of SRV and A records
+        ttl_service=4500,       ///< TTL of PTR and TXT records
+        ttl_legacy=10           ///< TTL of answers to legacy resolvers
+    };
+
+    /// The rendered answers of a bridge and the identity they were rendered for
+    struct Bridge
+    {
+        std::string uuid;
+        std::string bridgeid;
+        std::string server;
+        std::string service;
+        bool resolving=false;
+        std::string instance;   ///< Lower case instance name for matching, empty until rendered
+        std::string host;       ///< Lower case host name for matching
+        std::string answers;    ///< The four answer records
+        std::string legacy;     ///< The same records with #ttl_legacy
+        boost::posix_time::ptime multicast;     ///< Time of the last multicast answer
+    };
+
+    Router &_router;
+    Admission &_admission;
+    Statistics &_stats;
+    const Coordinator *_coordinator=nullptr;
+    ip::udp::socket _socket;
+    ip::tcp::resolver _resolver;
+    deadline_timer _timer;
+    const ip::udp::endpoint _group;
+    std::unordered_map<const Responder*, Bridge> _bridges;
+    std::vector<Bridge*> _answer;   ///< Bridges to answer for the current query
+    ip::udp::endpoint _sender_endpoint;
+    static const uint16_t _max_length=1500;
+    uint8_t _data[_max_length];
+
+public:
+    /// The constructor opens the mDNS port, joins the multicast group and starts listening.
+    MdnsResponder(io_service &io_service, Router &router, Admission &admission, Statistics &stats) :
+        _router(router), _admission(admission), _stats(stats), _socket(io_service), _resolver(io_service),
+        _timer(io_service), _group(ip::address::from_string("224.0.0.251"), mdns_port)
+    {
+        const ip::udp::endpoint listen_endpoint(ip::address_v4::any(), mdns_port);
+        _socket.open(listen_endpoint.protocol());
+        _socket.set_option(ip::udp::socket::reuse_address(true));
+        _socket.bind(listen_endpoint);
+        _socket.set_option(ip::multicast::join_group(_group.address()));
+        _socket.set_option(ip::multicast::hops(255));
+        _socket.set_option(ip::unicast::hops(255));
+
+        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
+            boost::bind(&MdnsResponder::receive, this, placeholders::error, placeholders::bytes_transferred));
+        check(boost::system::error_code());
+    }
+
+    /// Answers and announces only while coordinator says this instance leads.
+    void coordinator(const Coordinator &coordinator)
+    {
+        _coordinator=&coordinator;
+    }
+
+private:
+    /// Renders and announces the bridges whose identity or server changed.
+    void check(const boost::system::error_code &e)
+    {
+        if (e) return;
+        ++_stats.wakeups;
+        for (const Responder *resp: _router.all()) render(*resp);
+        _timer.expires_from_now(boost::posix_time::seconds(t_refresh_min));
+        _timer.async_wait(boost::bind(&MdnsResponder::check, this, placeholders::error));
+    }
+
+    void receive(const boost::system::error_code &error, size_t bytes)
+    {
+        if (error) return;
+        ++_stats.wakeups;
+        query(bytes);
+        _socket.async_receive_from(buffer(_data, _max_length), _sender_endpoint,
+            boost::bind(&MdnsResponder::receive, this, placeholders::error, placeholders::bytes_transferred));
+    }
+
+    static uint16_t get16(const uint8_t *p)
+    {
+        return p[0]<<8|p[1];
+    }
+
+    /**
+     * Reads a possibly compressed name from the received packet as lower case dotted name.
+     *
+     * \param bytes     The length of the packet
+     * \param pos       The position of the name, moved behind it
+     * \param name      Receives the name
+     * \param len       Receives the length of the name
+     * \return          False if the name is malformed
+     */
+    bool read_name(size_t bytes, size_t &pos, char (&name)[256], size_t &len) const
+    {
+        len=0;
+        size_t p=pos;
+        bool jumped=false;
+        for (int hops=0; hops<16; )
+        {
+            if (p>=bytes) return false;
+            const uint8_t l=_data[p];
+            if ((l&0xc0)==0xc0)
+            {
+                if (p+1>=bytes) return false;
+                if (!jumped) pos=p+2;
+                jumped=true;
+                p=(l&0x3f)<<8|_data[p+1];
+                ++hops;
+                continue;
+            }
+            if (l==0)
+            {
+                if (!jumped) pos=p+1;
+                return true;
+            }
+            if (l>63 || p+1+l>bytes || len+l+1>sizeof(name)-1) return false;
+            if (len) name[len++]='.';
+            for (size_t i=0; i<l; ++i) name[len++]=::tolower(_data[p+1+i]);
+            p+=1+l;
+        }
+        return false;
+    }
+
+    /// Evaluates a received query.
+    void query(size_t bytes)
+    {
+        if (bytes<12 || (_data[2]&0xf8)) return;    // Responses and other opcodes than QUERY
+        if (_coordinator && !_coordinator->leader()) return;
+        const ip::address addr=_sender_endpoint.address();
+        const std::vector<Responder*> &bridges=_router(addr);
+        if (bridges.empty()) return;
+
+        const bool legacy=_sender_endpoint.port()!=mdns_port;
+        const size_t questions=get16(_data+4), answers=get16(_data+6);
+        char name[256];
+        size_t len;
+        size_t pos=12, question_end=12;
+        bool unicast=legacy;
+        _answer.clear();
+        for (size_t q=0; q<questions; ++q)
+        {
+            if (!read_name(bytes, pos, name, len) || pos+4>bytes) return;
+            const uint16_t type=get16(_data+pos), cls=get16(_data+pos+2);
+            pos+=4;
+            if (q==0) question_end=pos;
+            const std::string_view n(name, len);
+            for (Responder *resp: bridges)
+            {
+                Bridge *b=render(*resp);
+                if (!b) continue;
+                if ((n=="_hue._tcp.local" && (type==type_ptr || type==type_any)) ||
+                    (n==b->instance && (type==type_srv || type==type_txt || type==type_any)) ||
+                    (n==b->host && (type==type_a || type==type_any)))
+                {
+                    if (std::find(_answer.begin(), _answer.end(), b)==_answer.end()) _answer.push_back(b);
+                    if (cls&class_flush) unicast=true;
+                }
+            }
+        }
+        if (_answer.empty()) return;
+        ++_stats.mdns_queries;
+
+        // Known answer suppression
+        for (size_t a=0; a<answers; ++a)
+        {
+            if (!read_name(bytes, pos, name, len) || pos+10>bytes) break;
+            const uint16_t type=get16(_data+pos);
+            const uint32_t ttl=static_cast<uint32_t>(get16(_data+pos+4))<<16|get16(_data+pos+6);
+            const size_t rdlength=get16(_data+pos+8);
+            pos+=10;
+            const bool ptr=type==type_ptr && std::string_view(name, len)=="_hue._tcp.local";
+            size_t rdata=pos;
+            pos+=rdlength;
+            if (!ptr || !read_name(bytes, rdata, name, len) || ttl<ttl_service/2) continue;
+            const auto known=std::find_if(_answer.begin(), _answer.end(),
+                [&](const Bridge *b) { return b->instance==std::string_view(name, len); });
+            if (known==_answer.end()) continue;
+            _answer.erase(known);
+            ++_stats.mdns_suppressed;
+        }
+        if (_answer.empty()) return;
+
+        const Priority prio=_admission.priority(addr);
+        if (!_admission.admit(addr, prio, _answer.size())) return;
+
+        const boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        for (Bridge *b: _answer)
+        {
+            if (!unicast && now-b->multicast<boost::posix_time::seconds(1)) continue;
+            // Header: ID, flags (response, authoritative), questions, answers, authority, additional
+            const uint8_t header[12]={legacy ? _data[0] : uint8_t(0), legacy ? _data[1] : uint8_t(0), 0x84, 0,
+                0, legacy ? uint8_t(1) : uint8_t(0), 0, 4, 0, 0, 0, 0};
+            const std::array<const_buffer, 3> packet={buffer(header),
+                buffer(_data+12, legacy ? question_end-12 : 0), buffer(legacy ? b->legacy : b->answers)};
+            boost::system::error_code ignored;
+            _socket.send_to(packet, unicast ? _sender_endpoint : _group, 0, ignored);
+            if (!unicast) b->multicast=now;
+            ++_stats.mdns_answers;
+        }
+    }
+
+    /**
+     * Returns the rendered answers of a bridge, or nullptr if they are not available yet. A changed
+     * identity or server renders and announces the answers, a server given by name is resolved first.
+     */
+    Bridge *render(const Responder &resp)
+    {
+        if (!resp.ready()) return nullptr;
+        Bridge &b=_bridges[&resp];
+        if (b.uuid!=resp.uuid() || b.bridgeid!=resp.bridgeid() || b.server!=resp.server() ||
+            b.service!=resp.service())
+        {
+            b.uuid=resp.uuid();
+            b.bridgeid=resp.bridgeid();
+            b.server=resp.server();
+            b.service=resp.service();
+            b.instance.clear();
+            boost::system::error_code ec;
+            const ip::address addr=ip::make_address(b.server, ec);
+            const unsigned long port=strtoul(b.service.c_str(), nullptr, 10);
+            if (!ec && addr.is_v4() && port && port<=0xffff && !b.resolving)
+                publish(b, ip::tcp::endpoint(addr, port));
+            else if (!b.resolving)
+            {
+                b.resolving=true;
+                _resolver.async_resolve(b.server, b.service,
+                    boost::bind(&MdnsResponder::resolved, this, &resp, placeholders::error, placeholders::results));
+            }
+        }
+        return b.resolving || b.instance.empty() ? nullptr : &b;
+    }
+
+    /// Publishes the answers of a bridge for the resolved address of its server.
+    void resolved(const Responder *resp, const boost::system::error_code &e,
+        const ip::tcp::resolver::results_type &endpoints)
+    {
+        ++_stats.wakeups;
+        Bridge &b=_bridges[resp];
+        b.resolving=false;
+        if (b.server!=resp->server() || b.service!=resp->service())
+        {
+            // The server changed meanwhile
+            b.server.clear();
+            render(*resp);
+            return;
+        }
+        const auto v4=std::find_if(endpoints.begin(), endpoints.end(),
+            [](const ip::tcp::endpoint &ep) { return ep.address().is_v4(); });
+        if (e || v4==endpoints.end())
+        {
+            std::cerr << "mDNS: no IPv4 address of " << b.server << "." << std::endl;
+            return;
+        }
+        publish(b, v4->endpoint());
+    }
+
+    /// Renders the answers of a bridge at the given endpoint and announces them.
+    void publish(Bridge &b, const ip::tcp::endpoint &endpoint)
+    {
+        std::string id=b.bridgeid.empty() ? bridge_id(b.uuid.substr(b.uuid.rfind('-')+1)) : b.bridgeid;
+        const std::string instance="Philips Hue - "+id.substr(id.size()>6 ? id.size()-6 : 0);
+        std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+        const std::string host="hue-"+id+".local";
+        const uint16_t port=endpoint.port();
+        const ip::address_v4::bytes_type a=endpoint.address().to_v4().to_bytes();
+
+        std::string instance_name, host_name, service_name, srv, txt;
+        labels(instance_name, instance+"._hue._tcp.local");
+        labels(host_name, host);
+        labels(service_name, "_hue._tcp.local");
+        srv.assign({0, 0, 0, 0, static_cast<char>(port>>8), static_cast<char>(port&0xff)});
+        srv+=host_name;
+        for (const std::string &t: {"bridgeid="+id, std::string("modelid=BSB002")})
+        {
+            txt+=static_cast<char>(t.size());
+            txt+=t;
+        }
+        for (std::string *answers: {&b.answers, &b.legacy})
+        {
+            const bool legacy=answers==&b.legacy;
+            answers->clear();
+            record(*answers, service_name, type_ptr, class_in, legacy ? ttl_legacy : ttl_service, instance_name);
+            record(*answers, instance_name, type_srv, class_in|class_flush, legacy ? ttl_legacy : ttl_host, srv);
+            record(*answers, instance_name, type_txt, class_in|class_flush, legacy ? ttl_legacy : ttl_service, txt);
+            record(*answers, host_name, type_a, class_in|class_flush, legacy ? ttl_legacy : ttl_host,
+                std::string(a.begin(), a.end()));
+        }
+        b.instance=instance+"._hue._tcp.local";
+        std::transform(b.instance.begin(), b.instance.end(), b.instance.begin(), ::tolower);
+        b.host=host;
+
+        // Announce the new answers
+        if (_coordinator && !_coordinator->leader()) return;
+        const uint8_t header[12]={0, 0, 0x84, 0, 0, 0, 0, 4, 0, 0, 0, 0};
+        const std::array<const_buffer, 2> packet={buffer(header), buffer(b.answers)};
+        boost::system::error_code ignored;
+        _socket.send_to(packet, _group, 0, ignored);
+        b.multicast=boost::posix_time::microsec_clock::universal_time();
+        ++_stats.mdns_answers;
+    }
+
+    /// Appends a dotted name as DNS labels.
+    static void labels(std::string &out, const std::string &name)
+    {
+        std::istringstream dotted(name);
+        for (std::string label; std::getline(dotted, label, '.'); )
+        {
+            out+=static_cast<char>(label.size());
+            out+=label;
+        }
+        out+='\0';
+    }
+
+    /// Appends a resource record, owner is already encoded by labels().
+    static void record(std::string &out, const std::string &owner, uint16_t type, uint16_t cls, uint32_t ttl,
+        const std::string &rdata)
+    {
+        out+=owner;
+        out.append({static_cast<char>(type>>8), static_cast<char>(type), static_cast<char>(cls>>8),
+            static_cast<char>(cls), static_cast<char>(ttl>>24), static_cast<char>(ttl>>16),
+            static_cast<char>(ttl>>8), static_cast<char>(ttl), static_cast<char>(rdata.size()>>8),
+            static_cast<char>(rdata.size())});
+        out+=rdata;
+    }
+};
+
+#endif // HUED_HPP
@@ -0,0 +1,248 @@
+/**
+ * @file libhued.cpp
+ *
+ * C API of the embeddable HUE SSDP responder, see libhued.h
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "hued.hpp"
+#include "libhued.h"
+
+struct hued
+{
+    io_service io;
+    Statistics stats;
+    Router router;
+    Admission admission;
+    Listener listener;
+    std::vector<std::unique_ptr<hued_bridge>> bridges;
+    std::thread thread;
+    std::mutex loop;    ///< Held by the thread running the event loop, by hued_run(), hued_start() or hued_poll()
+    std::atomic<std::thread::id> runner;    ///< The thread holding loop, none while it is free
+
+    hued() :
+        admission(stats),
+        listener(io, router, admission, stats, ip::address::from_string("0.0.0.0"),
+            ip::address::from_string("239.255.255.250"))
+    {
+    }
+};
+
+struct hued_bridge
+{
+    hued *h;
+    Responder resp;
+
+    hued_bridge(hued *h, const char *server, const char *service) :
+        h(h), resp(h->io, server, service, h->stats)
+    {
+    }
+};
+
+/// Holds the event loop of an instance for the calling thread.
+struct Running
+{
+    hued *h;
+    std::lock_guard<std::mutex> lock;
+
+    Running(hued *h) : h(h), lock(h->loop)
+    {
+        h->runner=std::this_thread::get_id();
+    }
+
+    ~Running()
+    {
+        h->runner=std::thread::id();
+    }
+};
+
+/// Checks if the calling thread runs the event loop of h, so it is called by a handler of the instance.
+static bool inside(const hued *h)
+{
+    return h->runner==std::this_thread::get_id();
+}
+
+hued *hued_create(void)
+{
+    try
+    {
+        return new hued();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "libhued: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+void hued_destroy(hued *h)
+{
+    if (!h) return;
+    hued_stop(h);
+    delete h;
+}
+
+hued_bridge *hued_add_bridge(hued *h, const char *server, const char *service)
+{
+    try
+    {
+        std::unique_ptr<hued_bridge> b(new hued_bridge(h, server, service));
+        Responder *resp=&b->resp;
+        h->bridges.push_back(std::move(b));
+        // The router belongs to the thread running the instance
+        post(h->io, [h, resp]() { h->router.add(*resp); });
+        return h->bridges.back().get();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "libhued: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+int hued_set_identity(hued_bridge *b, const char *uuid, const char *bridgeid)
+{
+    const std::string id(uuid ? uuid : "");
+    if (id.empty())
+    {
+        std::cerr << "libhued: The UUID must not be empty." << std::endl;
+        return -1;
+    }
+    const std::string bid=bridgeid ? std::string(bridgeid) : bridge_id(id.substr(id.rfind('-')+1));
+    post(b->h->io, [b, id, bid]() { b->resp.identity(id, bid); });
+    return 0;
+}
+
+int hued_run(hued *h)
+{
+    if (inside(h))
+    {
+        std::cerr << "libhued: hued_run() must not be called from inside the event loop." << std::endl;
+        return -1;
+    }
+    try
+    {
+        Running running(h);
+        h->io.restart();
+        h->io.run();
+        return 0;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "libhued: " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+int hued_poll(hued *h)
+{
+    if (inside(h))
+    {
+        std::cerr << "libhued: hued_poll() must not be called from inside the event loop." << std::endl;
+        return -1;
+    }
+    try
+    {
+        Running running(h);
+        if (h->io.stopped()) h->io.restart();
+        return h->io.poll();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "libhued: " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+int hued_start(hued *h)
+{
+    if (h->thread.joinable())
+    {
+        std::cerr << "libhued: The instance is already running." << std::endl;
+        return -1;
+    }
+    h->io.restart();
+    h->thread=std::thread([h]() { hued_run(h); });
+    return 0;
+}
+
+void hued_stop(hued *h)
+{
+    h->io.stop();
+    if (h->thread.joinable() && h->thread.get_id()!=std::this_thread::get_id()) h->thread.join();
+}
+
+size_t hued_stats(hued *h, char *buf, size_t size)
+{
+    std::string line;
+    for (;;)
+    {
+        // Without a thread running the event loop nothing updates the counters, and none can start meanwhile.
+        // Called by a handler of the instance, the calling thread is the one which updates them.
+        std::unique_lock<std::mutex> idle(h->loop, std::defer_lock);
+        if (inside(h) || idle.try_lock())
+        {
+            std::ostringstream os;
+            h->stats.print(os);
+            line=os.str();
+            break;
+        }
+
+        // Read the counters in the thread which updates them. If the loop stops before it runs the handler,
+        // the wait times out and the lock is tried again, the handler keeps its promise alive by itself.
+        std::shared_ptr<std::promise<std::string>> done=std::make_shared<std::promise<std::string>>();
+        post(h->io, [h, done]()
+            {
+                std::ostringstream os;
+                h->stats.print(os);
+                done->set_value(os.str());
+            });
+        std::future<std::string> printed=done->get_future();
+        if (printed.wait_for(std::chrono::milliseconds(100))==std::future_status::ready)
+        {
+            line=printed.get();
+            break;
+        }
+    }
+
+    if (!line.empty() && line.back()=='\n') line.pop_back();
+    if (size)
+    {
+        const size_t n=std::min(line.size(), size-1);
+        memcpy(buf, line.data(), n);
+        buf[n]=0;
+    }
+    return line.size();
+}
@@ -0,0 +1,119 @@
+/**
+ * @file libhued.h
+ *
+ * C API of the embeddable HUE SSDP responder
+ *
+ * Bridge emulators like HA-Bridge (via JNI) or node-red (via N-API) can run the responder in their own
+ * process and push the UUID of each bridge directly instead of letting hued poll the description.xml.
+ * An instance either runs in a thread of its own (hued_start()), in a thread of the caller (hued_run())
+ * or in the event loop of the caller by calling hued_poll() periodically. Functions returning int return
+ * 0 on success and -1 on failure, the error is written to stderr.
+ *
+ * Inside the event loop, i.e. from a handler run by hued_run(), hued_start() or hued_poll(), only
+ * hued_add_bridge(), hued_set_identity(), hued_stats() and hued_stop() may be called. hued_run() and
+ * hued_poll() fail there, hued_destroy() must not be called.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIBHUED_H
+#define LIBHUED_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// A responder instance with its own SSDP listener
+typedef struct hued hued;
+/// A bridge advertised by an instance
+typedef struct hued_bridge hued_bridge;
+
+/**
+ * Creates an instance, which listens for searches on the SSDP port. Nothing is answered before the
+ * instance runs and has bridges with an identity.
+ *
+ * \return          The instance, or NULL on failure
+ */
+hued *hued_create(void);
+
+/// Stops the instance and frees it including its bridges.
+void hued_destroy(hued *h);
+
+/**
+ * Adds a bridge, which is advertised as soon as its identity is set. May be called while the instance runs.
+ *
+ * \param server    The host name or address of the bridge (the emulator)
+ * \param service   Its HTTP port
+ * \return          The bridge, owned by the instance, or NULL on failure
+ */
+hued_bridge *hued_add_bridge(hued *h, const char *server, const char *service);
+
+/**
+ * Sets or changes the identity of a bridge. May be called from any thread while the instance runs, the
+ * change takes effect in the thread running the instance.
+ *
+ * \param uuid      The UUID of the bridge
+ * \param bridgeid  The hue-bridgeid, or NULL for the last group of the UUID with FFFE in the middle
+ */
+int hued_set_identity(hued_bridge *b, const char *uuid, const char *bridgeid);
+
+/// Runs the instance in the calling thread until hued_stop() is called.
+int hued_run(hued *h);
+
+/**
+ * Runs the handlers of the instance which are ready, without waiting. For the event loop of the caller.
+ *
+ * \return          The number of handlers run, or -1 on failure
+ */
+int hued_poll(hued *h);
+
+/// Runs the instance in a thread of its own.
+int hued_start(hued *h);
+
+/// Stops the instance, waits for the thread started by hued_start(). The instance may be run again.
+void hued_stop(hued *h);
+
+/**
+ * Writes the statistics as a line of key=value pairs, like SIGUSR1 does for the daemon. May be called from
+ * any thread, while the instance runs the counters are read by the thread running it. Called from inside
+ * the event loop, the counters are read directly.
+ *
+ * \param buf       Receives the line, terminated by a NUL
+ * \param size      The size of buf
+ * \return          The length of the whole line, which was truncated if it is size or more
+ */
+size_t hued_stats(hued *h, char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBHUED_H
@@ -0,0 +1,328 @@
+/**
+ * @file log.hpp
+ *
+ * Asynchronous structured event log
+ *
+ * The event loop must not format or write anything while it answers searches. Log::push() stores a fixed
+ * size binary record in a lock-free single producer single consumer ring, a background thread formats the
+ * records as JSON lines on stdout or sends them to journald by its native datagram protocol. Each event
+ * type is limited to a number of records per second, further records of that second are only counted
+ * and reported with the next record of the type. A full ring drops records and counts them, too.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Lock-free ring for one producer and one consumer thread.
+ *
+ * \tparam T    A trivially copyable record
+ * \tparam N    The capacity, a power of two
+ */
+template<typename T, size_t N>
+class SpscQueue
+{
+private:
+    static_assert((N&(N-1))==0, "The capacity must be a power of two");
+    alignas(64) std::atomic<size_t> _head{0};   ///< Next slot to write, only written by the producer
+    alignas(64) std::atomic<size_t> _tail{0};   ///< Next slot to read, only written by the consumer
+    alignas(64) std::array<T, N> _slots;
+
+public:
+    /// Appends a record, returns false if the ring is full. Producer only.
+    bool push(const T &record)
+    {
+        const size_t head=_head.load(std::memory_order_relaxed);
+        if (head-_tail.load(std::memory_order_acquire)==N) return false;
+        _slots[head&(N-1)]=record;
+        _head.store(head+1, std::memory_order_release);
+        return true;
+    }
+
+    /// Takes the oldest record, returns false if the ring is empty. Consumer only.
+    bool pop(T &record)
+    {
+        const size_t tail=_tail.load(std::memory_order_relaxed);
+        if (tail==_head.load(std::memory_order_acquire)) return false;
+        record=_slots[tail&(N-1)];
+        _tail.store(tail+1, std::memory_order_release);
+        return true;
+    }
+};
+
+/// Structured event log, see the file description
+class Log
+{
+public:
+    /// The event types, see _events for their names and arguments
+    enum Event : uint8_t
+    {
+        event_search,       ///< A search for a supported service type, arguments MX and answering bridges
+        event_denied,       ///< A search of a requester routed to no bridge
+        event_shed,         ///< A search dropped because of overload, argument the priority class
+        event_standby,      ///< A search not answered because another instance leads
+        event_leader,       ///< This instance became the leader (argument 1) or a standby (0)
+        event_count
+    };
+
+    enum Format
+    {
+        format_json,        ///< JSON lines on stdout
+        format_journal      ///< journald native protocol
+    };
+
+private:
+    /// A fixed size record as queued by push()
+    struct Record
+    {
+        int64_t time;       ///< Microseconds since the epoch
+        uint8_t event;
+        uint8_t family;     ///< AF_INET, AF_INET6 or 0 without address
+        uint16_t port;
+        uint32_t suppressed;    ///< Records of this type dropped before this one
+        uint32_t arg[2];
+        uint8_t addr[16];
+    };
+
+    /// Name and argument names of an event type
+    struct Type
+    {
+        const char *name;
+        const char *arg[2];
+        int priority;       ///< syslog priority for journald
+    };
+    static constexpr Type _events[event_count]=
+    {
+        {"search", {"mx", "bridges"}, 7},
+        {"denied", {nullptr, nullptr}, 6},
+        {"shed", {"priority", nullptr}, 5},
+        {"standby", {nullptr, nullptr}, 7},
+        {"leader", {"leader", nullptr}, 5},
+    };
+
+    /// Sampling state of an event type, only used by the producer
+    struct Budget
+    {
+        int64_t second=0;
+        uint32_t used=0;
+        uint32_t suppressed=0;
+    };
+
+    SpscQueue<Record, 4096> _queue;
+    std::array<Budget, event_count> _budgets;
+    uint32_t _rate;
+    uint64_t &_dropped;
+    Format _format;
+    int _journal=-1;
+    std::atomic<bool> _stop{false};
+    std::atomic<bool> _sleeping{false};
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::thread _thread;
+
+public:
+    /**
+     * Starts the formatting thread.
+     *
+     * \param format    The output
+     * \param rate      The maximum records per second and event type
+     * \param dropped   Counts the records lost because the ring was full, only updated by push()
+     */
+    Log(Format format, uint32_t rate, uint64_t &dropped) : _rate(rate), _dropped(dropped), _format(format)
+    {
+        if (_format==format_journal)
+        {
+            _journal=socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+            sockaddr_un addr={};
+            addr.sun_family=AF_UNIX;
+            strcpy(addr.sun_path, "/run/systemd/journal/socket");
+            if (_journal<0 || connect(_journal, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))!=0)
+            {
+                if (_journal>=0) close(_journal);
+                throw std::runtime_error("journald not available");
+            }
+        }
+        _thread=std::thread(&Log::run, this);
+    }
+
+    ~Log()
+    {
+        _stop=true;
+        _wakeup.notify_one();
+        _thread.join();
+        if (_journal>=0) close(_journal);
+    }
+
+    /**
+     * Logs an event. Never blocks and never allocates, only one thread may call it.
+     *
+     * \param addr      The address of the requester in network byte order, nullptr if none
+     * \param bytes     4 for IPv4 or 16 for IPv6
+     */
+    void push(Event event, const uint8_t *addr=nullptr, unsigned bytes=0, uint16_t port=0, uint32_t arg0=0,
+        uint32_t arg1=0)
+    {
+        const int64_t now=std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        Budget &budget=_budgets[event];
+        if (now/1000000!=budget.second)
+        {
+            budget.second=now/1000000;
+            budget.used=0;
+        }
+        if (budget.used>=_rate)
+        {
+            ++budget.suppressed;
+            return;
+        }
+
+        Record record;
+        record.time=now;
+        record.event=event;
+        record.family=bytes==4 ? AF_INET : bytes==16 ? AF_INET6 : 0;
+        record.port=port;
+        record.suppressed=budget.suppressed;
+        record.arg[0]=arg0;
+        record.arg[1]=arg1;
+        if (addr) memcpy(record.addr, addr, bytes);
+        if (!_queue.push(record))
+        {
+            ++_dropped;
+            return;
+        }
+        ++budget.used;
+        budget.suppressed=0;
+        if (_sleeping.load(std::memory_order_relaxed)) _wakeup.notify_one();
+    }
+
+private:
+    /// Formats the records until the log is destroyed.
+    void run()
+    {
+        Record record;
+        std::string out;
+        while (!_stop)
+        {
+            while (_queue.pop(record)) write(record, out);
+            // A wakeup lost between the check and the wait is made up by the timeout
+            std::unique_lock<std::mutex> lock(_mutex);
+            _sleeping=true;
+            _wakeup.wait_for(lock, std::chrono::seconds(1));
+            _sleeping=false;
+        }
+        while (_queue.pop(record)) write(record, out);
+    }
+
+    void write(const Record &record, std::string &out)
+    {
+        const Type &type=_events[record.event];
+        char time[40];
+        const time_t seconds=record.time/1000000;
+        tm utc;
+        gmtime_r(&seconds, &utc);
+        const size_t len=strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(time+len, sizeof(time)-len, ".%06uZ", static_cast<unsigned>(record.time%1000000));
+        char addr[INET6_ADDRSTRLEN]="";
+        if (record.family) inet_ntop(record.family, record.addr, addr, sizeof(addr));
+
+        out.clear();
+        if (_format==format_json)
+        {
+            out+="{\"time\":\"";
+            out+=time;
+            out+="\",\"event\":\"";
+            out+=type.name;
+            out+='"';
+            if (record.family)
+            {
+                out+=",\"addr\":\"";
+                out+=addr;
+                out+="\",\"port\":"+std::to_string(record.port);
+            }
+            for (size_t i=0; i<2; ++i)
+                if (type.arg[i]) out+=",\""+std::string(type.arg[i])+"\":"+std::to_string(record.arg[i]);
+            if (record.suppressed) out+=",\"suppressed\":"+std::to_string(record.suppressed);
+            out+="}\n";
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+        }
+        else
+        {
+            out+="MESSAGE=";
+            out+=type.name;
+            if (record.family)
+            {
+                out+=" from ";
+                out+=addr;
+            }
+            out+="\nPRIORITY="+std::to_string(type.priority)+"\nSYSLOG_IDENTIFIER=hued\nHUED_EVENT=";
+            out+=type.name;
+            out+="\nHUED_TIME=";
+            out+=time;
+            if (record.family)
+            {
+                out+="\nHUED_ADDR=";
+                out+=addr;
+                out+="\nHUED_PORT="+std::to_string(record.port);
+            }
+            for (size_t i=0; i<2; ++i)
+            {
+                if (!type.arg[i]) continue;
+                out+="\nHUED_";
+                for (const char *c=type.arg[i]; *c; ++c) out+=toupper(*c);
+                out+="="+std::to_string(record.arg[i]);
+            }
+            if (record.suppressed) out+="\nHUED_SUPPRESSED="+std::to_string(record.suppressed);
+            out+='\n';
+            send(_journal, out.data(), out.size(), MSG_NOSIGNAL);
+        }
+    }
+};
+
+#endif // LOG_HPP
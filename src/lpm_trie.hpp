@@ -0,0 +1,132 @@
+/**
+ * @file lpm_trie.hpp
+ *
+ * Longest prefix match trie for IPv4 and IPv6 addresses
+ *
+ * The trie has a stride of 8 bits, i.e. every node holds 256 slots and a lookup visits at most one node
+ * per address byte (4 for IPv4, 16 for IPv6), independent of the number of stored prefixes. Prefixes
+ * which do not end on a byte boundary are expanded into all slots they cover (controlled prefix
+ * expansion), a slot keeps the value of the longest prefix covering it.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LPM_TRIE_HPP
+#define LPM_TRIE_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Longest prefix match trie mapping IPv4 and IPv6 prefixes to values of type T.
+ *
+ * Addresses are given as byte arrays in network byte order. IPv4 (4 bytes) and IPv6 (16 bytes) prefixes
+ * live in separate trees, so 0.0.0.0/0 does not match IPv6 addresses and vice versa.
+ */
+template<typename T>
+class LpmTrie
+{
+private:
+    /// One of the 256 slots of a node
+    struct Slot
+    {
+        uint32_t child=0;   ///< Index of the child node for longer prefixes, 0 if none
+        int16_t len=-1;     ///< Length of the prefix which set value, -1 if no prefix covers this slot
+        T value=T();
+    };
+    typedef std::array<Slot, 256> Node;
+
+    /// Node 0 is the IPv4 root, node 1 the IPv6 root
+    std::vector<Node> _nodes;
+
+public:
+    LpmTrie() : _nodes(2)
+    {
+    }
+
+    /**
+     * Stores a prefix. A prefix of the same length replaces the previous value.
+     *
+     * \param prefix    The address bytes of the prefix, bits behind len are ignored
+     * \param bytes     4 for IPv4 or 16 for IPv6
+     * \param len       The prefix length in bits, 0 is the default route
+     * \param value     The value returned by find() for addresses matching this prefix
+     */
+    void insert(const uint8_t *prefix, unsigned bytes, unsigned len, const T &value)
+    {
+        uint32_t node=bytes==4 ? 0 : 1;
+        const unsigned level=len ? (len-1)/8 : 0;
+        for (unsigned i=0; i<level; ++i)
+        {
+            if (!_nodes[node][prefix[i]].child)
+            {
+                // emplace_back may move the nodes, so no references are kept over this call
+                _nodes.emplace_back();
+                _nodes[node][prefix[i]].child=_nodes.size()-1;
+            }
+            node=_nodes[node][prefix[i]].child;
+        }
+
+        // Expand the remaining 0..8 bits into all covered slots
+        const unsigned rest=len-level*8;
+        const unsigned first=rest ? prefix[level]&(0xff<<(8-rest))&0xff : 0;
+        const unsigned count=1u<<(8-rest);
+        for (unsigned i=first; i<first+count; ++i)
+        {
+            Slot &slot=_nodes[node][i];
+            if (slot.len>static_cast<int16_t>(len)) continue;
+            slot.len=len;
+            slot.value=value;
+        }
+    }
+
+    /**
+     * Looks up the value of the longest prefix matching addr.
+     *
+     * \param addr      The address bytes
+     * \param bytes     4 for IPv4 or 16 for IPv6
+     * \return          A pointer to the value, or nullptr if no prefix matches
+     */
+    const T *find(const uint8_t *addr, unsigned bytes) const
+    {
+        const T *best=nullptr;
+        uint32_t node=bytes==4 ? 0 : 1;
+        for (unsigned i=0; i<bytes; ++i)
+        {
+            const Slot &slot=_nodes[node][addr[i]];
+            if (slot.len>=0) best=&slot.value;
+            if (!slot.child) break;
+            node=slot.child;
+        }
+        return best;
+    }
+};
+
+#endif // LPM_TRIE_HPP
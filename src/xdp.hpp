@@ -0,0 +1,488 @@
+/**
+ * @file xdp.hpp
+ *
+ * AF_XDP socket for SSDP searches
+ *
+ * A small XDP program on the network interface redirects UDP datagrams to the SSDP port which start with
+ * "M-SEARCH" into an AF_XDP socket, all other frames pass to the network stack as before. The frames are
+ * received from a UMEM ring in batches and replies are written directly into the TX ring, bypassing the
+ * socket stack. The socket uses the copy mode, so it works with generic (SKB) XDP on any interface,
+ * including veth, and needs no special NIC driver.
+ *
+ * The program and the map are loaded by plain bpf() syscalls, so no libbpf is needed. Only IPv4 frames
+ * without IP options are redirected, everything else is left to the socket path.
+ *
+ * @author Andreas Schmitt
+ */
+
+/*
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef XDP_HPP
+#define XDP_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+/**
+ * AF_XDP socket bound to queue 0 of one network interface.
+ *
+ * Frames arriving on other queues are not redirected and reach the normal UDP socket, so the socket path
+ * stays active as well. The XDP program is detached when the object is destroyed.
+ */
+class XdpSocket
+{
+private:
+    /// A producer/consumer ring shared with the kernel
+    struct Ring
+    {
+        void *map=MAP_FAILED;
+        size_t map_len=0;
+        uint32_t *producer=nullptr;
+        uint32_t *consumer=nullptr;
+        void *desc=nullptr;
+        uint32_t mask=0;
+    };
+
+    static const uint32_t _frame_size=2048;
+    static const uint32_t _ring_size=512;   ///< Entries of each ring, half of the UMEM frames are for RX
+    static const size_t _headers=sizeof(ethhdr)+sizeof(iphdr)+sizeof(udphdr);
+
+    uint16_t _port;
+    int _ifindex=0;
+    uint8_t _mac[ETH_ALEN];
+    uint32_t _addr=0;       ///< IPv4 address of the interface, network byte order
+    uint8_t *_umem=static_cast<uint8_t*>(MAP_FAILED);
+    int _fd=-1;
+    int _map=-1;
+    int _prog=-1;
+    int _link=-1;
+    Ring _fill, _completion, _rx, _tx;
+    std::vector<uint64_t> _free;    ///< TX frames not owned by the kernel
+    bool _kick=false;       ///< The TX ring has new entries
+    const uint8_t *_frame=nullptr;  ///< The frame handled by the current receive() handler
+    uint16_t _id=0;
+
+public:
+    /**
+     * Loads the XDP program on the interface and opens the socket.
+     *
+     * \param ifname    The network interface
+     * \param port      The UDP port of the redirected datagrams
+     * \throws std::runtime_error with the failed step, if AF_XDP is not available
+     */
+    XdpSocket(const std::string &ifname, uint16_t port) : _port(port)
+    {
+        try
+        {
+            open(ifname);
+        }
+        catch(...)
+        {
+            close();
+            throw;
+        }
+    }
+
+    ~XdpSocket()
+    {
+        close();
+    }
+
+    XdpSocket(const XdpSocket &)=delete;
+    XdpSocket &operator=(const XdpSocket &)=delete;
+
+    /// The socket, readable when frames are waiting in the RX ring
+    int fd() const
+    {
+        return _fd;
+    }
+
+    /**
+     * Handles all frames waiting in the RX ring and sends the replies queued by the handler.
+     *
+     * \param handler   Called as handler(saddr, sport, payload, bytes) for each frame, with the IPv4 source
+     *                  address in network byte order and the source port in host byte order. The handler
+     *                  may call reply() to answer the frame.
+     * \return          The number of frames
+     */
+    template<typename Handler>
+    size_t receive(Handler handler)
+    {
+        const uint32_t produced=__atomic_load_n(_rx.producer, __ATOMIC_ACQUIRE);
+        uint32_t consumed=*_rx.consumer;
+        uint32_t filled=*_fill.producer;
+        size_t frames=0;
+        for (; consumed!=produced; ++consumed, ++frames)
+        {
+            const xdp_desc &d=static_cast<const xdp_desc*>(_rx.desc)[consumed&_rx.mask];
+            const uint8_t *frame=_umem+d.addr;
+            if (d.len>=_headers)
+            {
+                const iphdr *ip=reinterpret_cast<const iphdr*>(frame+sizeof(ethhdr));
+                const udphdr *udp=reinterpret_cast<const udphdr*>(frame+sizeof(ethhdr)+sizeof(iphdr));
+                const size_t bytes=std::min<size_t>(ntohs(udp->len), d.len-sizeof(ethhdr)-sizeof(iphdr));
+                if (bytes>=sizeof(udphdr))
+                {
+                    _frame=frame;
+                    handler(ip->saddr, ntohs(udp->source), reinterpret_cast<const char*>(udp+1),
+                        bytes-sizeof(udphdr));
+                    _frame=nullptr;
+                }
+            }
+
+            // The frame goes back to the kernel for the next datagram
+            static_cast<uint64_t*>(_fill.desc)[filled++&_fill.mask]=d.addr-d.addr%_frame_size;
+        }
+        __atomic_store_n(_fill.producer, filled, __ATOMIC_RELEASE);
+        __atomic_store_n(_rx.consumer, consumed, __ATOMIC_RELEASE);
+        flush();
+        return frames;
+    }
+
+    /**
+     * Queues a reply to the frame handled by the current receive() handler in the TX ring.
+     *
+     * \param iov       The UDP payload as gather list
+     * \param count     The number of elements of iov
+     * \return          False if no TX frame is free or the payload is too large, the caller has to send the
+     *                  reply by its socket.
+     */
+    bool reply(const iovec *iov, size_t count)
+    {
+        if (!_frame) return false;
+        size_t payload=0;
+        for (size_t i=0; i<count; ++i) payload+=iov[i].iov_len;
+        if (_headers+payload>_frame_size) return false;
+        if (_free.empty()) complete();
+        if (_free.empty()) return false;
+
+        const uint64_t addr=_free.back();
+        _free.pop_back();
+        uint8_t *frame=_umem+addr;
+        const ethhdr *req_eth=reinterpret_cast<const ethhdr*>(_frame);
+        const iphdr *req_ip=reinterpret_cast<const iphdr*>(_frame+sizeof(ethhdr));
+        const udphdr *req_udp=reinterpret_cast<const udphdr*>(_frame+sizeof(ethhdr)+sizeof(iphdr));
+
+        ethhdr *eth=reinterpret_cast<ethhdr*>(frame);
+        memcpy(eth->h_dest, req_eth->h_source, ETH_ALEN);
+        memcpy(eth->h_source, _mac, ETH_ALEN);
+        eth->h_proto=htons(ETH_P_IP);
+
+        uint8_t *data=frame+_headers;
+        for (size_t i=0; i<count; ++i)
+        {
+            memcpy(data, iov[i].iov_base, iov[i].iov_len);
+            data+=iov[i].iov_len;
+        }
+
+        udphdr *udp=reinterpret_cast<udphdr*>(frame+sizeof(ethhdr)+sizeof(iphdr));
+        udp->source=htons(_port);
+        udp->dest=req_udp->source;
+        udp->len=htons(sizeof(udphdr)+payload);
+        udp->check=0;
+
+        iphdr *ip=reinterpret_cast<iphdr*>(frame+sizeof(ethhdr));
+        ip->version=4;
+        ip->ihl=5;
+        ip->tos=0;
+        ip->tot_len=htons(sizeof(iphdr)+sizeof(udphdr)+payload);
+        ip->id=htons(_id++);
+        ip->frag_off=htons(0x4000);    // Don't fragment
+        ip->ttl=64;
+        ip->protocol=IPPROTO_UDP;
+        ip->check=0;
+        ip->saddr=_addr;
+        ip->daddr=req_ip->saddr;
+        ip->check=checksum(ip, sizeof(iphdr), 0);
+
+        // The UDP checksum covers the pseudo header
+        const uint32_t pseudo[3]={ip->saddr, ip->daddr, htonl(IPPROTO_UDP<<16|(sizeof(udphdr)+payload))};
+        udp->check=checksum(udp, sizeof(udphdr)+payload, sum(pseudo, sizeof(pseudo)));
+        if (!udp->check) udp->check=0xffff;
+
+        const uint32_t produced=*_tx.producer;
+        xdp_desc &d=static_cast<xdp_desc*>(_tx.desc)[produced&_tx.mask];
+        d.addr=addr;
+        d.len=_headers+payload;
+        d.options=0;
+        __atomic_store_n(_tx.producer, produced+1, __ATOMIC_RELEASE);
+        _kick=true;
+        return true;
+    }
+
+private:
+    static int bpf(int cmd, bpf_attr &attr)
+    {
+        return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+    }
+
+    static void fail(const std::string &step)
+    {
+        throw std::runtime_error(step+": "+strerror(errno));
+    }
+
+    /// One's complement sum of len bytes, without folding
+    static uint32_t sum(const void *data, size_t len, uint32_t s=0)
+    {
+        const uint8_t *p=static_cast<const uint8_t*>(data);
+        for (; len>1; p+=2, len-=2) s+=p[0]<<8|p[1];
+        if (len) s+=p[0]<<8;
+        return s;
+    }
+
+    /// Internet checksum of len bytes in network byte order
+    static uint16_t checksum(const void *data, size_t len, uint32_t s)
+    {
+        s=sum(data, len, s);
+        while (s>>16) s=(s&0xffff)+(s>>16);
+        return htons(~s&0xffff);
+    }
+
+    /// Maps a ring of the socket.
+    void ring(Ring &r, const xdp_ring_offset &off, size_t entry, off_t pgoff, const char *name)
+    {
+        r.map_len=off.desc+_ring_size*entry;
+        r.map=mmap(nullptr, r.map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, pgoff);
+        if (r.map==MAP_FAILED) fail(std::string("mmap ")+name+" ring");
+        uint8_t *base=static_cast<uint8_t*>(r.map);
+        r.producer=reinterpret_cast<uint32_t*>(base+off.producer);
+        r.consumer=reinterpret_cast<uint32_t*>(base+off.consumer);
+        r.desc=base+off.desc;
+        r.mask=_ring_size-1;
+    }
+
+    void open(const std::string &ifname)
+    {
+        _ifindex=if_nametoindex(ifname.c_str());
+        if (!_ifindex) fail("Interface "+ifname);
+
+        // The replies are sent from the MAC and IPv4 address of the interface
+        const int s=socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ-1);
+        const bool hw=s>=0 && ioctl(s, SIOCGIFHWADDR, &ifr)==0;
+        if (hw) memcpy(_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+        const bool inet=hw && ioctl(s, SIOCGIFADDR, &ifr)==0;
+        if (inet) _addr=reinterpret_cast<const sockaddr_in*>(&ifr.ifr_addr)->sin_addr.s_addr;
+        if (s>=0) ::close(s);
+        if (!inet) fail("Addresses of "+ifname);
+
+        // UMEM with _ring_size frames for RX followed by _ring_size frames for TX
+        const size_t umem_len=2*_ring_size*_frame_size;
+        _umem=static_cast<uint8_t*>(mmap(nullptr, umem_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+        if (_umem==MAP_FAILED) fail("UMEM");
+
+        _fd=socket(AF_XDP, SOCK_RAW|SOCK_CLOEXEC, 0);
+        if (_fd<0) fail("AF_XDP socket");
+        xdp_umem_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.addr=reinterpret_cast<uint64_t>(_umem);
+        reg.len=umem_len;
+        reg.chunk_size=_frame_size;
+        if (setsockopt(_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))<0) fail("UMEM registration");
+        const int size=_ring_size;
+        if (setsockopt(_fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size))<0 ||
+            setsockopt(_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size))<0 ||
+            setsockopt(_fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size))<0 ||
+            setsockopt(_fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size))<0) fail("Ring sizes");
+
+        xdp_mmap_offsets off;
+        socklen_t len=sizeof(off);
+        if (getsockopt(_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len)<0) fail("Ring offsets");
+        ring(_fill, off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, "fill");
+        ring(_completion, off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, "completion");
+        ring(_rx, off.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING, "RX");
+        ring(_tx, off.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING, "TX");
+
+        for (uint32_t i=0; i<_ring_size; ++i)
+        {
+            static_cast<uint64_t*>(_fill.desc)[i]=static_cast<uint64_t>(i)*_frame_size;
+            _free.push_back(static_cast<uint64_t>(_ring_size+i)*_frame_size);
+        }
+        __atomic_store_n(_fill.producer, _ring_size, __ATOMIC_RELEASE);
+
+        sockaddr_xdp sxdp;
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family=AF_XDP;
+        sxdp.sxdp_ifindex=_ifindex;
+        sxdp.sxdp_queue_id=0;
+        sxdp.sxdp_flags=XDP_COPY;
+        if (bind(_fd, reinterpret_cast<sockaddr*>(&sxdp), sizeof(sxdp))<0) fail("Binding to "+ifname);
+
+        bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type=BPF_MAP_TYPE_XSKMAP;
+        attr.key_size=sizeof(uint32_t);
+        attr.value_size=sizeof(uint32_t);
+        attr.max_entries=1;
+        _map=bpf(BPF_MAP_CREATE, attr);
+        if (_map<0) fail("XSKMAP");
+        const uint32_t queue=0;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd=_map;
+        attr.key=reinterpret_cast<uint64_t>(&queue);
+        attr.value=reinterpret_cast<uint64_t>(&_fd);
+        if (bpf(BPF_MAP_UPDATE_ELEM, attr)<0) fail("XSKMAP update");
+
+        load();
+
+        // A link detaches the program when hued exits, even after a crash
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd=_prog;
+        attr.link_create.target_ifindex=_ifindex;
+        attr.link_create.attach_type=BPF_XDP;
+        attr.link_create.flags=XDP_FLAGS_SKB_MODE;
+        _link=bpf(BPF_LINK_CREATE, attr);
+        if (_link<0) fail("Attaching XDP program to "+ifname);
+    }
+
+    /// Loads the XDP program, which redirects IPv4 UDP datagrams to _port starting with "M-SEARCH".
+    void load()
+    {
+        std::vector<bpf_insn> prog;
+        std::vector<size_t> to_pass;    // Jumps to the final XDP_PASS
+        auto insn=[&](uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+            {
+                bpf_insn i;
+                memset(&i, 0, sizeof(i));
+                i.code=code;
+                i.dst_reg=dst;
+                i.src_reg=src;
+                i.off=off;
+                i.imm=imm;
+                prog.push_back(i);
+            };
+        // Loads size bytes at r2+off into r5 and continues only if they equal the in-memory value imm
+        auto expect=[&](uint8_t size, int16_t off, int32_t imm)
+            {
+                insn(BPF_LDX|size|BPF_MEM, BPF_REG_5, BPF_REG_2, off, 0);
+                to_pass.push_back(prog.size());
+                insn(BPF_JMP32|BPF_JNE|BPF_K, BPF_REG_5, 0, 0, imm);
+            };
+        uint32_t m_se, arch;
+        memcpy(&m_se, "M-SE", 4);
+        memcpy(&arch, "ARCH", 4);
+        const int16_t payload=_headers;
+
+        insn(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+        insn(BPF_LDX|BPF_W|BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(xdp_md, data), 0);
+        insn(BPF_LDX|BPF_W|BPF_MEM, BPF_REG_3, BPF_REG_1, offsetof(xdp_md, data_end), 0);
+        insn(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+        insn(BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_4, 0, 0, payload+8);
+        to_pass.push_back(prog.size());
+        insn(BPF_JMP|BPF_JGT|BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+        expect(BPF_H, offsetof(ethhdr, h_proto), htons(ETH_P_IP));
+        expect(BPF_B, sizeof(ethhdr), 0x45);    // IPv4 without options
+        expect(BPF_B, sizeof(ethhdr)+offsetof(iphdr, protocol), IPPROTO_UDP);
+        // No fragments
+        insn(BPF_LDX|BPF_H|BPF_MEM, BPF_REG_5, BPF_REG_2, sizeof(ethhdr)+offsetof(iphdr, frag_off), 0);
+        insn(BPF_ALU64|BPF_AND|BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));   // More fragments and offset
+        to_pass.push_back(prog.size());
+        insn(BPF_JMP|BPF_JNE|BPF_K, BPF_REG_5, 0, 0, 0);
+        expect(BPF_H, sizeof(ethhdr)+sizeof(iphdr)+offsetof(udphdr, dest), htons(_port));
+        expect(BPF_W, payload, m_se);
+        expect(BPF_W, payload+4, arch);
+        // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)
+        insn(BPF_LDX|BPF_W|BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, rx_queue_index), 0);
+        insn(BPF_LD|BPF_DW|BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, _map);
+        insn(0, 0, 0, 0, 0);
+        insn(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+        insn(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+        insn(BPF_JMP|BPF_EXIT, 0, 0, 0, 0);
+        const size_t pass=prog.size();
+        insn(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+        insn(BPF_JMP|BPF_EXIT, 0, 0, 0, 0);
+        for (size_t j: to_pass) prog[j].off=pass-j-1;
+
+        static const char license[]="BSL-1.0";
+        bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type=BPF_PROG_TYPE_XDP;
+        attr.insns=reinterpret_cast<uint64_t>(prog.data());
+        attr.insn_cnt=prog.size();
+        attr.license=reinterpret_cast<uint64_t>(license);
+        _prog=bpf(BPF_PROG_LOAD, attr);
+        if (_prog<0) fail("Loading XDP program");
+    }
+
+    /// Returns the sent TX frames from the completion ring to the free list.
+    void complete()
+    {
+        const uint32_t produced=__atomic_load_n(_completion.producer, __ATOMIC_ACQUIRE);
+        uint32_t consumed=*_completion.consumer;
+        for (; consumed!=produced; ++consumed)
+            _free.push_back(static_cast<uint64_t*>(_completion.desc)[consumed&_completion.mask]);
+        __atomic_store_n(_completion.consumer, consumed, __ATOMIC_RELEASE);
+    }
+
+    /// Wakes the kernel to send the queued TX frames, the copy mode needs a syscall for this.
+    void flush()
+    {
+        if (_kick) sendto(_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+        _kick=false;
+        complete();
+    }
+
+    void close()
+    {
+        if (_link>=0) ::close(_link);
+        if (_prog>=0) ::close(_prog);
+        if (_map>=0) ::close(_map);
+        for (Ring *r: {&_fill, &_completion, &_rx, &_tx})
+        {
+            if (r->map!=MAP_FAILED) munmap(r->map, r->map_len);
+            r->map=MAP_FAILED;
+        }
+        if (_fd>=0) ::close(_fd);
+        if (_umem!=MAP_FAILED) munmap(_umem, 2*_ring_size*_frame_size);
+        _umem=static_cast<uint8_t*>(MAP_FAILED);
+        _link=_prog=_map=_fd=-1;
+    }
+};
+
+#endif // XDP_HPP